@@ -11,6 +11,7 @@
 #include "TMath.h"
 #include "TRandom.h"
 
+#include <cmath>
 #include <string>
 
 TClonesArray *JetEvent::fgJets = 0;
@@ -109,6 +110,123 @@ void JetEvent::Build(Int_t jetm, Int_t trackm, Int_t hitam, Int_t hitbm) {
   // Info("Build()", msg.c_str());
 }
 
+////////////////////////////////////////////////////////////////////////////////
+/// Build one event for load tests.
+/// Same distributions as Build(), but the gaussian deviates are drawn in
+/// batches, the multiplicities are drawn first so that each TClonesArray is
+/// sized once, and the objects of the previous event are reused in place
+/// instead of being constructed again. With a fixed seed the events are
+/// reproducible, though not identical to the ones of Build().
+
+void JetEvent::BuildFast(Int_t jetm, Int_t trackm, Int_t hitam, Int_t hitbm) {
+  // Save current Object count
+  Int_t ObjectNumber = TProcessID::GetObjectCount();
+
+  fVertex.SetXYZ(NextGaus(0, 0.1), NextGaus(0, 0.2), NextGaus(0, 10));
+
+  Int_t njets = (Int_t)NextGaus(jetm, 1);
+  if (njets < 1)
+    njets = 1;
+  fMultiplicity.clear();
+  fNjet = njets;
+  fNtrack = fNhitA = fNhitB = 0;
+  for (Int_t j = 0; j < njets; j++) {
+    Int_t ntracks = (Int_t)NextGaus(trackm, 3);
+    if (ntracks < 1)
+      ntracks = 1;
+    fMultiplicity.push_back(ntracks);
+    fNtrack += ntracks;
+    for (Int_t t = 0; t < ntracks; t++) {
+      Int_t nhitsA = TMath::Max((Int_t)NextGaus(hitam, 5), 0);
+      Int_t nhitsB = TMath::Max((Int_t)NextGaus(hitbm, 2), 0);
+      fMultiplicity.push_back(nhitsA);
+      fMultiplicity.push_back(nhitsB);
+      fNhitA += nhitsA;
+      fNhitB += nhitsB;
+    }
+  }
+  // Objects left from the previous event are kept, only new slots are
+  // default constructed.
+  fJets->ExpandCreateFast(fNjet);
+  fTracks->ExpandCreateFast(fNtrack);
+  fHitsA->ExpandCreateFast(fNhitA);
+  fHitsB->ExpandCreateFast(fNhitB);
+
+  Int_t itrack = 0, ihitA = 0, ihitB = 0;
+  std::vector<Int_t>::const_iterator mult = fMultiplicity.begin();
+  for (Int_t j = 0; j < njets; j++) {
+    Jet *jet = (Jet *)fJets->UncheckedAt(j);
+    // A reused object must get a fresh uid from the TRefArray
+    jet->ResetBit(kIsReferenced);
+    jet->SetUniqueID(0);
+    jet->fTracks.Clear();
+    jet->fPt = NextGaus(0, 10);
+    jet->fPhi = 2 * TMath::Pi() * gRandom->Rndm();
+    Int_t ntracks = *mult++;
+    for (Int_t t = 0; t < ntracks; t++) {
+      Track *track = (Track *)fTracks->UncheckedAt(itrack++);
+      track->ResetBit(kIsReferenced);
+      track->SetUniqueID(0);
+      track->fHits.Clear();
+      track->fPx = NextGaus(0, 1);
+      track->fPy = NextGaus(0, 1);
+      track->fPz = NextGaus(0, 5);
+      jet->fTracks.Add(track);
+      Int_t nhitsA = *mult++;
+      Int_t nhitsB = *mult++;
+      for (Int_t ha = 0; ha < nhitsA; ha++) {
+        Hit *hit = (Hit *)fHitsA->UncheckedAt(ihitA++);
+        hit->ResetBit(kIsReferenced);
+        hit->SetUniqueID(0);
+        hit->fX = 10000 * j + 100 * t + ha;
+        hit->fY = 10000 * j + 100 * t + ha + 0.1;
+        hit->fZ = 10000 * j + 100 * t + ha + 0.2;
+        track->fHits.Add(hit);
+      }
+      for (Int_t hb = 0; hb < nhitsB; hb++) {
+        Hit *hit = (Hit *)fHitsB->UncheckedAt(ihitB++);
+        hit->ResetBit(kIsReferenced);
+        hit->SetUniqueID(0);
+        hit->fX = 20000 * j + 100 * t + hb + 0.3;
+        hit->fY = 20000 * j + 100 * t + hb + 0.4;
+        hit->fZ = 20000 * j + 100 * t + hb + 0.5;
+        track->fHits.Add(hit);
+      }
+      track->fNhit = nhitsA + nhitsB;
+    }
+  }
+  // Restore Object count, see Build()
+  TProcessID::SetObjectCount(ObjectNumber);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Refill the batch of standard normal deviates: one RndmArray call for the
+/// uniforms, then the Box-Muller transform turns each pair into two
+/// deviates in a loop without calls into the generator.
+
+void JetEvent::FillNormals() {
+  const Int_t kBatch = 4096;
+  fNormals.resize(kBatch);
+  gRandom->RndmArray(kBatch, fNormals.data());
+  Double_t *u = fNormals.data();
+  for (Int_t i = 0; i < kBatch; i += 2) {
+    Double_t u1 = u[i] > 0 ? u[i] : 1e-300;
+    Double_t r = std::sqrt(-2 * std::log(u1));
+    Double_t phi = 2 * TMath::Pi() * u[i + 1];
+    u[i] = r * std::cos(phi);
+    u[i + 1] = r * std::sin(phi);
+  }
+  fNextNormal = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Double_t JetEvent::NextGaus(Double_t mean, Double_t sigma) {
+  if (fNextNormal >= (Int_t)fNormals.size())
+    FillNormals();
+  return mean + sigma * fNormals[fNextNormal++];
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 /// Add a new Jet to the list of tracks for this event.
 
@@ -167,3 +285,126 @@ void JetEvent::Reset(Option_t *) {
   delete fgHitsB;
   fgHitsB = 0;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+/// Create a FlatJetEvent object.
+
+FlatJetEvent::FlatJetEvent()
+    : fVertexX(0), fVertexY(0), fVertexZ(0), fNjet(0), fNtrack(0), fNhitA(0),
+      fNhitB(0) {}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Build one event with the same distributions as JetEvent::Build
+
+void FlatJetEvent::Build(Int_t jetm, Int_t trackm, Int_t hitam, Int_t hitbm) {
+  Clear();
+
+  fVertexX = gRandom->Gaus(0, 0.1);
+  fVertexY = gRandom->Gaus(0, 0.2);
+  fVertexZ = gRandom->Gaus(0, 10);
+
+  Int_t njets = (Int_t)gRandom->Gaus(jetm, 1);
+  if (njets < 1)
+    njets = 1;
+  for (Int_t j = 0; j < njets; j++) {
+    fJetPt.push_back(gRandom->Gaus(0, 10));
+    fJetPhi.push_back(2 * TMath::Pi() * gRandom->Rndm());
+    fJetFirstTrack.push_back(fTrackPx.size());
+    Int_t ntracks = (Int_t)gRandom->Gaus(trackm, 3);
+    if (ntracks < 1)
+      ntracks = 1;
+    for (Int_t t = 0; t < ntracks; t++) {
+      fTrackPx.push_back(gRandom->Gaus(0, 1));
+      fTrackPy.push_back(gRandom->Gaus(0, 1));
+      fTrackPz.push_back(gRandom->Gaus(0, 5));
+      fTrackFirstHitA.push_back(fHitAX.size());
+      fTrackFirstHitB.push_back(fHitBX.size());
+      Int_t nhitsA = TMath::Max((Int_t)gRandom->Gaus(hitam, 5), 0);
+      for (Int_t ha = 0; ha < nhitsA; ha++) {
+        fHitAX.push_back(10000 * j + 100 * t + ha);
+        fHitAY.push_back(10000 * j + 100 * t + ha + 0.1);
+        fHitAZ.push_back(10000 * j + 100 * t + ha + 0.2);
+      }
+      Int_t nhitsB = TMath::Max((Int_t)gRandom->Gaus(hitbm, 2), 0);
+      for (Int_t hb = 0; hb < nhitsB; hb++) {
+        fHitBX.push_back(20000 * j + 100 * t + hb + 0.3);
+        fHitBY.push_back(20000 * j + 100 * t + hb + 0.4);
+        fHitBZ.push_back(20000 * j + 100 * t + hb + 0.5);
+      }
+      fTrackNhit.push_back(nhitsA + nhitsB);
+    }
+  }
+  fNjet = fJetPt.size();
+  fNtrack = fTrackPx.size();
+  fNhitA = fHitAX.size();
+  fNhitB = fHitBX.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Empty the columns, their capacity is kept for the next event.
+
+void FlatJetEvent::Clear(Option_t *) {
+  fNjet = fNtrack = fNhitA = fNhitB = 0;
+  fJetPt.clear();
+  fJetPhi.clear();
+  fJetFirstTrack.clear();
+  fTrackPx.clear();
+  fTrackPy.clear();
+  fTrackPz.clear();
+  fTrackNhit.clear();
+  fTrackFirstHitA.clear();
+  fTrackFirstHitB.clear();
+  fHitAX.clear();
+  fHitAY.clear();
+  fHitAZ.clear();
+  fHitBX.clear();
+  fHitBY.clear();
+  fHitBZ.clear();
+}
+
+#ifdef TMPI_RNTUPLE
+////////////////////////////////////////////////////////////////////////////////
+/// Bare model (no default entry): entries are bound to events with
+/// BindNTupleEntry.
+
+std::unique_ptr<TMPINTuple::RNTupleModel> FlatJetEvent::MakeNTupleModel() {
+  auto model = TMPINTuple::RNTupleModel::CreateBare();
+  for (const char *name : {"fVertexX", "fVertexY", "fVertexZ"})
+    model->MakeField<Float_t>(name);
+  for (const char *name : {"fNjet", "fNtrack", "fNhitA", "fNhitB"})
+    model->MakeField<Int_t>(name);
+  for (const char *name : {"fJetPt", "fJetPhi", "fTrackPx", "fTrackPy", "fTrackPz",
+                           "fHitAX", "fHitAY", "fHitAZ", "fHitBX", "fHitBY", "fHitBZ"})
+    model->MakeField<std::vector<Float_t>>(name);
+  for (const char *name : {"fJetFirstTrack", "fTrackNhit", "fTrackFirstHitA", "fTrackFirstHitB"})
+    model->MakeField<std::vector<Int_t>>(name);
+  return model;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void FlatJetEvent::BindNTupleEntry(TMPINTuple::REntry &entry) {
+  entry.BindRawPtr("fVertexX", &fVertexX);
+  entry.BindRawPtr("fVertexY", &fVertexY);
+  entry.BindRawPtr("fVertexZ", &fVertexZ);
+  entry.BindRawPtr("fNjet", &fNjet);
+  entry.BindRawPtr("fNtrack", &fNtrack);
+  entry.BindRawPtr("fNhitA", &fNhitA);
+  entry.BindRawPtr("fNhitB", &fNhitB);
+  entry.BindRawPtr("fJetPt", &fJetPt);
+  entry.BindRawPtr("fJetPhi", &fJetPhi);
+  entry.BindRawPtr("fJetFirstTrack", &fJetFirstTrack);
+  entry.BindRawPtr("fTrackPx", &fTrackPx);
+  entry.BindRawPtr("fTrackPy", &fTrackPy);
+  entry.BindRawPtr("fTrackPz", &fTrackPz);
+  entry.BindRawPtr("fTrackNhit", &fTrackNhit);
+  entry.BindRawPtr("fTrackFirstHitA", &fTrackFirstHitA);
+  entry.BindRawPtr("fTrackFirstHitB", &fTrackFirstHitB);
+  entry.BindRawPtr("fHitAX", &fHitAX);
+  entry.BindRawPtr("fHitAY", &fHitAY);
+  entry.BindRawPtr("fHitAZ", &fHitAZ);
+  entry.BindRawPtr("fHitBX", &fHitBX);
+  entry.BindRawPtr("fHitBY", &fHitBY);
+  entry.BindRawPtr("fHitBZ", &fHitBZ);
+}
+#endif
@@ -13,6 +13,13 @@
 #include "TRefArray.h"
 #include "TVector3.h"
 
+#ifdef TMPI_RNTUPLE
+#include "TMPINTuple.h"
+#endif
+
+#include <memory>
+#include <vector>
+
 class Hit : public TObject {
 
 public:
@@ -78,11 +85,20 @@ private:
   static TClonesArray *fgHitsA;
   static TClonesArray *fgHitsB;
 
+  std::vector<Double_t> fNormals;    //! batch of N(0,1) deviates for BuildFast
+  Int_t fNextNormal = 0;             //! next unused deviate in fNormals
+  std::vector<Int_t> fMultiplicity;  //! tracks per jet, hits per track
+
+  void FillNormals();
+  Double_t NextGaus(Double_t mean, Double_t sigma);
+
 public:
   JetEvent();
   virtual ~JetEvent();
   void Build(Int_t jetm, Int_t trackm = 10, Int_t hitam = 100,
              Int_t hitbm = 10);
+  void BuildFast(Int_t jetm, Int_t trackm = 10, Int_t hitam = 100,
+                 Int_t hitbm = 10);
   void Clear(Option_t *option = "");
   void Reset(Option_t *option = "");
   Int_t GetNjet() const { return fNjet; }
@@ -98,4 +114,60 @@ public:
   ClassDef(JetEvent, 1) // Event structure
 };
 
+// Columnar variant of JetEvent with the same content: every jet, track and
+// hit attribute is a std::vector column, and the jet -> track -> hit links
+// are indices of the first track (hit) of each jet (track) instead of
+// TRefArrays, so filling a tree costs no per-object streaming nor TProcessID
+// bookkeeping.
+class FlatJetEvent : public TObject {
+
+private:
+  Float_t fVertexX; // vertex coordinates
+  Float_t fVertexY;
+  Float_t fVertexZ;
+  Int_t fNjet;   // Number of jets
+  Int_t fNtrack; // Number of tracks
+  Int_t fNhitA;  // Number of hits in detector A
+  Int_t fNhitB;  // Number of hits in detector B
+
+  std::vector<Float_t> fJetPt;        // Pt of jets
+  std::vector<Float_t> fJetPhi;       // Phi of jets
+  std::vector<Int_t> fJetFirstTrack;  // index of the first track of each jet
+  std::vector<Float_t> fTrackPx;      // X component of the track momenta
+  std::vector<Float_t> fTrackPy;      // Y component of the track momenta
+  std::vector<Float_t> fTrackPz;      // Z component of the track momenta
+  std::vector<Int_t> fTrackNhit;      // Number of hits of each track
+  std::vector<Int_t> fTrackFirstHitA; // index of the first hit A of each track
+  std::vector<Int_t> fTrackFirstHitB; // index of the first hit B of each track
+  std::vector<Float_t> fHitAX;        // hits in detector A
+  std::vector<Float_t> fHitAY;
+  std::vector<Float_t> fHitAZ;
+  std::vector<Float_t> fHitBX;        // hits in detector B
+  std::vector<Float_t> fHitBY;
+  std::vector<Float_t> fHitBZ;
+
+public:
+  FlatJetEvent();
+  virtual ~FlatJetEvent() {}
+  void Build(Int_t jetm, Int_t trackm = 10, Int_t hitam = 100,
+             Int_t hitbm = 10);
+  void Clear(Option_t *option = "");
+  Int_t GetNjet() const { return fNjet; }
+  Int_t GetNtrack() const { return fNtrack; }
+  Int_t GetNhitA() const { return fNhitA; }
+  Int_t GetNhitB() const { return fNhitB; }
+  // Tracks of jet j are [GetJetFirstTrack(j), GetJetFirstTrack(j + 1))
+  Int_t GetJetFirstTrack(Int_t j) const { return j < fNjet ? fJetFirstTrack[j] : fNtrack; }
+  Float_t GetTrackPx(Int_t t) const { return fTrackPx[t]; }
+
+#ifdef TMPI_RNTUPLE
+  // RNTuple model with one field per data member, named after it
+  static std::unique_ptr<TMPINTuple::RNTupleModel> MakeNTupleModel();
+  // Point the fields of an entry of that model at this event's members
+  void BindNTupleEntry(TMPINTuple::REntry &entry);
+#endif
+
+  ClassDef(FlatJetEvent, 1) // Columnar event structure
+};
+
 #endif
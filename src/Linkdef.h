@@ -4,9 +4,19 @@
 #pragma link off all functions;
 #pragma link C++ nestedclasses;
 #pragma link C++ class TMPIFile + ;
+#pragma link C++ class TMPIThreadFile + ;
+#pragma link C++ class TClientMemFile + ;
 #pragma link C++ class TClientInfo + ;
+#pragma link C++ class TBufferPool + ;
+#pragma link C++ class TMPIMetrics + ;
+#pragma link C++ class TMPIWindow + ;
+#pragma link C++ class TMPIHistMerge + ;
+#pragma link C++ class TMPIRing + ;
+#pragma link C++ class TMPILocalGroup + ;
+#pragma link C++ class TMappedFile + ;
 #pragma link C++ class Jet + ;
 #pragma link C++ class Hit + ;
 #pragma link C++ class Track + ;
 #pragma link C++ class JetEvent + ;
+#pragma link C++ class FlatJetEvent + ;
 #endif
@@ -0,0 +1,112 @@
+// @(#)root/io:$Id$
+
+/*************************************************************************
+ * Copyright (C) 1995-2002, Rene Brun and Fons Rademakers.               *
+ * All rights reserved.                                                  *
+ *                                                                       *
+ * For the licensing terms see $ROOTSYS/LICENSE.                         *
+ * For the list of contributors see $ROOTSYS/README/CREDITS.             *
+ *************************************************************************/
+
+#include "TBufferPool.h"
+#include "TError.h"
+
+#include <iostream>
+
+ClassImp(TBufferPool);
+
+TBufferPool::TBufferPool(Long64_t blockSize, Long64_t highWater)
+    : fBlockSize(blockSize > 0 ? blockSize : kDefaultBlockSize), fHighWater(highWater) {}
+
+TBufferPool::~TBufferPool() {
+  Trim(0);
+  // Buffers still in use belong to pending requests, the owner of the pool
+  // has to complete them before destroying it.
+  for (auto &used : fUsed) {
+    delete[] used.first;
+  }
+}
+
+char *TBufferPool::Acquire(Long64_t size) {
+  if (size < 1) {
+    size = 1;
+  }
+  Long64_t capacity = ((size + fBlockSize - 1) / fBlockSize) * fBlockSize;
+  ++fStats.fAcquired;
+
+  char *buffer = 0;
+  auto it = fFree.lower_bound(capacity);
+  if (it != fFree.end()) {
+    // Best fit: the smallest retained buffer large enough for the request.
+    capacity = it->first;
+    buffer = it->second;
+    fFree.erase(it);
+    fStats.fBytesRetained -= capacity;
+    ++fStats.fReuses;
+  } else {
+    buffer = new char[capacity];
+    ++fStats.fAllocations;
+  }
+  fUsed[buffer] = capacity;
+  fStats.fBytesInUse += capacity;
+  if (fStats.fBytesInUse + fStats.fBytesRetained > fStats.fPeakBytes) {
+    fStats.fPeakBytes = fStats.fBytesInUse + fStats.fBytesRetained;
+  }
+  return buffer;
+}
+
+void TBufferPool::Release(char *buffer) {
+  if (!buffer) {
+    return;
+  }
+  auto it = fUsed.find(buffer);
+  if (it == fUsed.end()) {
+    Error("TBufferPool::Release", "buffer %p does not belong to this pool", (void *)buffer);
+    return;
+  }
+  Long64_t capacity = it->second;
+  fUsed.erase(it);
+  fStats.fBytesInUse -= capacity;
+
+  if (capacity > fHighWater) {
+    // could never be retained, the buffers kept for the regular syncs stay
+    delete[] buffer;
+    ++fStats.fFrees;
+    return;
+  }
+  if (fStats.fBytesRetained + capacity > fHighWater) {
+    // make room by dropping smaller buffers first
+    Trim(fHighWater - capacity);
+  }
+  fFree.emplace(capacity, buffer);
+  fStats.fBytesRetained += capacity;
+}
+
+void TBufferPool::Trim(Long64_t target) {
+  while (!fFree.empty() && fStats.fBytesRetained > target) {
+    auto it = fFree.begin();
+    fStats.fBytesRetained -= it->first;
+    delete[] it->second;
+    fFree.erase(it);
+    ++fStats.fFrees;
+  }
+}
+
+void TBufferPool::SetBlockSize(Long64_t blockSize) {
+  if (blockSize > 0) {
+    fBlockSize = blockSize;
+  }
+}
+
+void TBufferPool::SetHighWater(Long64_t highWater) {
+  fHighWater = highWater;
+  Trim(fHighWater);
+}
+
+void TBufferPool::Print() const {
+  std::cout << "buffer pool: acquired " << fStats.fAcquired << "\t allocations "
+            << fStats.fAllocations << "\t reuses " << fStats.fReuses
+            << "\t frees " << fStats.fFrees << "\t retained (MB) "
+            << fStats.fBytesRetained / 1024. / 1024. << "\t peak (MB) "
+            << fStats.fPeakBytes / 1024. / 1024. << std::endl;
+}
@@ -0,0 +1,64 @@
+// @(#)root/io:$Id$
+
+/*************************************************************************
+ * Copyright (C) 1995-2009, Rene Brun and Fons Rademakers.               *
+ * All rights reserved.                                                  *
+ *                                                                       *
+ * For the licensing terms see $ROOTSYS/LICENSE.                         *
+ * For the list of contributors see $ROOTSYS/README/CREDITS.             *
+ *************************************************************************/
+
+#ifndef ROOT_TBufferPool
+#define ROOT_TBufferPool
+
+#include "Rtypes.h"
+
+#include <map>
+#include <unordered_map>
+
+// Pool of message buffers reused across syncs. Buffer sizes are rounded up
+// to a multiple of the block size so that images of slightly different
+// sizes share the same buffers; released buffers are kept for reuse until
+// the retained bytes reach the high-water mark.
+class TBufferPool {
+
+public:
+  struct Stats {
+    ULong64_t fAcquired = 0;     // number of Acquire() calls
+    ULong64_t fAllocations = 0;  // Acquire() calls that hit the heap
+    ULong64_t fReuses = 0;       // Acquire() calls served from the pool
+    ULong64_t fFrees = 0;        // buffers returned to the heap
+    Long64_t fBytesInUse = 0;    // bytes handed out and not yet released
+    Long64_t fBytesRetained = 0; // bytes kept in the free list
+    Long64_t fPeakBytes = 0;     // peak of in-use + retained bytes
+  };
+
+private:
+  Long64_t fBlockSize;
+  Long64_t fHighWater;
+  std::multimap<Long64_t, char *> fFree;      //! free buffers by capacity
+  std::unordered_map<char *, Long64_t> fUsed; //! capacity of buffers in use
+  Stats fStats;
+
+  void Trim(Long64_t target);
+
+public:
+  static const Long64_t kDefaultBlockSize = 1024 * 1024;
+  static const Long64_t kDefaultHighWater = 256 * 1024 * 1024;
+
+  TBufferPool(Long64_t blockSize = kDefaultBlockSize, Long64_t highWater = kDefaultHighWater);
+  virtual ~TBufferPool();
+
+  char *Acquire(Long64_t size);
+  void Release(char *buffer);
+
+  void SetBlockSize(Long64_t blockSize);
+  void SetHighWater(Long64_t highWater);
+  Long64_t GetBlockSize() const { return fBlockSize; }
+  Long64_t GetHighWater() const { return fHighWater; }
+  const Stats &GetStats() const { return fStats; }
+  void Print() const;
+
+  ClassDef(TBufferPool, 0)
+};
+#endif
@@ -13,26 +13,154 @@
 #include "TSystem.h"
 #include "TClass.h"
 #include "TKey.h"
+#include "Bytes.h"
 
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+ClassImp(TClientMemFile);
 ClassImp(TClientInfo);
 
+// FNV-1a
+static ULong64_t R__Hash(const char *data, Long64_t len) {
+  ULong64_t hash = 14695981039346656037ULL;
+  for (Long64_t i = 0; i < len; ++i) {
+    hash = (hash ^ (UChar_t)data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+TClientMemFile::TClientMemFile(const char *name, char *buffer, Long64_t size)
+    : TMemFile(name, buffer, size, "UPDATE") {
+  fInfoHash = HashStreamerInfo(buffer, size);
+}
+
+// Hash of the streamer info record of an image, past its key header whose
+// date changes with every write; 0 if the image has none.
+ULong64_t TClientMemFile::HashStreamerInfo(const char *buffer, Long64_t size) const {
+  if (fSeekInfo <= fBEGIN || fSeekInfo + fNbytesInfo > size || fNbytesInfo < 16) {
+    return 0;
+  }
+  char *p = (char *)buffer + fSeekInfo + 14; // Nbytes, Version, ObjLen, Datime
+  Short_t keylen;
+  frombuf(p, &keylen);
+  if (keylen < 16 || keylen > fNbytesInfo) {
+    return R__Hash(buffer + fSeekInfo, fNbytesInfo);
+  }
+  return R__Hash(buffer + fSeekInfo + keylen, fNbytesInfo - keylen);
+}
+
+// Pick up fEND and the location of the streamer info from the file header
+// of the new image (see TFile::WriteHeader for the layout).
+Bool_t TClientMemFile::ReadHeader(const char *buffer, Long64_t size) {
+  if (size < 64 || strncmp(buffer, "root", 4)) {
+    return kFALSE;
+  }
+  char *p = (char *)buffer + 4;
+  Int_t version, begin, nbytesFree, nfree, nbytesName, nbytesInfo;
+  char units;
+  Int_t compress;
+  frombuf(p, &version);
+  frombuf(p, &begin);
+  if (version < 1000000) {
+    Int_t end, seekFree, seekInfo;
+    frombuf(p, &end);
+    frombuf(p, &seekFree);
+    frombuf(p, &nbytesFree);
+    frombuf(p, &nfree);
+    frombuf(p, &nbytesName);
+    frombuf(p, &units);
+    frombuf(p, &compress);
+    frombuf(p, &seekInfo);
+    fEND = end;
+    fSeekInfo = seekInfo;
+  } else {
+    Long64_t end, seekFree, seekInfo;
+    frombuf(p, &end);
+    frombuf(p, &seekFree);
+    frombuf(p, &nbytesFree);
+    frombuf(p, &nfree);
+    frombuf(p, &nbytesName);
+    frombuf(p, &units);
+    frombuf(p, &compress);
+    frombuf(p, &seekInfo);
+    fEND = end;
+    fSeekInfo = seekInfo;
+  }
+  frombuf(p, &nbytesInfo);
+  fNbytesInfo = nbytesInfo;
+  return fEND <= size;
+}
+
+Bool_t TClientMemFile::Repoint(const char *buffer, Long64_t size) {
+  // Objects read from the previous image (trees, subdirectories) refer to
+  // its content, drop them first.
+  GetList()->Delete("slow");
+  if (!ReadHeader(buffer, size)) {
+    Error("Repoint", "buffer of %lld bytes is not a ROOT file image", size);
+    return kFALSE;
+  }
+  // Overwrite the image in place, the block chain only grows if needed.
+  const Long64_t chunk = 1024 * 1024 * 1024;
+  Seek(0);
+  for (Long64_t offset = 0; offset < size; offset += chunk) {
+    Int_t len = (Int_t)(size - offset < chunk ? size - offset : chunk);
+    if (WriteBuffer(buffer + offset, len)) {
+      return kFALSE;
+    }
+  }
+  // Only re-read the streamer info when the client's schema changed: a
+  // changed record may well keep its size.
+  ULong64_t hash = HashStreamerInfo(buffer, size);
+  if (fSeekInfo > fBEGIN && hash != fInfoHash) {
+    ReadStreamerInfo();
+    fInfoHash = hash;
+  }
+  ReadKeys(kTRUE);
+  return kTRUE;
+}
+
 TClientInfo::TClientInfo()
-    : fFile(0), fLocalName(), fContactsCount(0), fTimeSincePrevContact(0) {}
+    : fFile(0), fInput(0), fLocalName(), fContactsCount(0), fTimeSincePrevContact(0) {}
 
 TClientInfo::~TClientInfo() {}
 TClientInfo::TClientInfo(const char *filename, UInt_t clientId)
-    : fFile(0), fContactsCount(0), fTimeSincePrevContact(0) {
+    : fFile(0), fInput(0), fContactsCount(0), fTimeSincePrevContact(0) {
   fLocalName.Form("%s-%d-%d", filename, clientId, gSystem->GetPid());
 }
 
+// Return a file holding the image received from this client. The first
+// image becomes the client's file; the following ones are loaded into a
+// single cached input file instead of constructing a TMemFile per message.
+TFile *TClientInfo::OpenInput(const char *name, char *buffer, Long64_t size) {
+  if (!fFile) {
+    // Keys are migrated into this one later on, it needs free-space
+    // bookkeeping so it stays a regular TMemFile.
+    return new TMemFile(name, buffer, size, "UPDATE");
+  }
+  if (!fInput) {
+    fInput = new TClientMemFile(name, buffer, size);
+    return fInput;
+  }
+  if (!fInput->Repoint(buffer, size)) {
+    return 0;
+  }
+  return fInput;
+}
+
 void TClientInfo::SetFile(TFile *file) {
   {
     // Register the new file as coming from this client.
     if (file != fFile) {
       if (fFile) {
         R__MigrateKey(fFile, file);
-        // delete the previous memory file (if any)
-        delete file;
+        // delete the previous memory file (if any), the cached input is
+        // kept for the next message
+        if (file != fInput) {
+          delete file;
+        }
       } else {
         fFile = file;
       }
@@ -44,72 +172,240 @@ void TClientInfo::SetFile(TFile *file) {
   }
 }
 
+// FNV-1a over the compressed payload of a key, without unzipping it.
+static ULong64_t R__HashPayload(TFile *file, TKey *key, std::vector<char> &scratch) {
+  Int_t len = key->GetNbytes() - key->GetKeylen();
+  scratch.resize(len);
+  if (len > 0 && file->ReadBuffer(scratch.data(), key->GetSeekKey() + key->GetKeylen(), len)) {
+    return 0;
+  }
+  return R__Hash(scratch.data(), len);
+}
+
+// Class lookups are cached by name: TClass::GetClass normalizes the name
+// on every call, which shows up when walking thousands of keys.
+static TClass *R__GetClass(const char *classname, TClientInfo::ClassCache_t &cache) {
+  auto it = cache.find(classname);
+  if (it != cache.end()) {
+    return it->second;
+  }
+  TClass *cl = TClass::GetClass(classname);
+  cache.emplace(classname, cl);
+  return cl;
+}
+
+static TDirectory *R__GetSubdir(TDirectory *dir, TKey *key) {
+  TDirectory *subdir = (TDirectory *)dir->GetList()->FindObject(key->GetName());
+  if (!subdir) {
+    subdir = (TDirectory *)key->ReadObj();
+  }
+  return subdir;
+}
+
+// RNTuple anchors (the class moved out of ROOT::Experimental in 6.34).
+// Their pages are addressed by offset within the file they were written
+// to, so they cannot be migrated like other keys: they are merged directly
+// from the received image and then treated like a reset object.
+Bool_t TClientInfo::R__IsNTuple(const char *classname) {
+  return strcmp(classname, "ROOT::RNTuple") == 0 ||
+         strcmp(classname, "ROOT::Experimental::RNTuple") == 0;
+}
+
 void TClientInfo::R__DeleteObject(TDirectory *dir, Bool_t withReset) {
   if (dir == 0)
     return;
 
-  TIter nextkey(dir->GetListOfKeys());
-  TKey *key;
-  while ((key = (TKey *)nextkey())) {
-    TClass *cl = TClass::GetClass(key->GetClassName());
-    if (cl->InheritsFrom(TDirectory::Class())) {
-      TDirectory *subdir =
-          (TDirectory *)dir->GetList()->FindObject(key->GetName());
-      if (!subdir) {
-        subdir = (TDirectory *)key->ReadObj();
+  ClassCache_t cache;
+  std::vector<TDirectory *> todo(1, dir);
+  while (!todo.empty()) {
+    dir = todo.back();
+    todo.pop_back();
+    TIter nextkey(dir->GetListOfKeys());
+    TKey *key;
+    while ((key = (TKey *)nextkey())) {
+      Bool_t ntuple = R__IsNTuple(key->GetClassName());
+      TClass *cl = ntuple ? 0 : R__GetClass(key->GetClassName(), cache);
+      if (!cl && !ntuple) {
+        continue;
       }
-      R__DeleteObject(subdir, withReset);
-    } else {
-      Bool_t todelete = kFALSE;
-      if (withReset) {
-        todelete = (0 != cl->GetResetAfterMerge());
+      if (cl && cl->InheritsFrom(TDirectory::Class())) {
+        TDirectory *subdir = R__GetSubdir(dir, key);
+        if (subdir) {
+          todo.push_back(subdir);
+        }
       } else {
-        todelete = (0 == cl->GetResetAfterMerge());
+        Bool_t reset = ntuple || 0 != cl->GetResetAfterMerge();
+        Bool_t todelete = withReset ? reset : !reset;
+        if (todelete) {
+          key->Delete();
+          dir->GetListOfKeys()->Remove(key);
+          delete key;
+        }
+      }
+    }
+  }
+}
+
+// Remove from 'dir', a new image of this client, the objects that are not
+// reset after a merge and are byte for byte those the client sent last
+// time: its file keeps the previous copy, which needs neither migrating nor
+// merging again. Returns the number of objects removed.
+Int_t TClientInfo::DropUnchanged(TDirectory *dir, Long64_t &lookups, Long64_t &savedBytes) {
+  if (dir == 0)
+    return 0;
+  TFile *file = dir->GetFile();
+  Int_t dropped = 0;
+  ClassCache_t cache;
+  std::vector<char> scratch;
+  std::vector<std::pair<TDirectory *, std::string>> todo(1, std::make_pair(dir, std::string()));
+  while (!todo.empty()) {
+    TDirectory *current = todo.back().first;
+    std::string path = todo.back().second;
+    todo.pop_back();
+    std::vector<TKey *> unchanged;
+    TIter nextkey(current->GetListOfKeys());
+    TKey *key;
+    while ((key = (TKey *)nextkey())) {
+      if (R__IsNTuple(key->GetClassName())) {
+        continue;
+      }
+      TClass *cl = R__GetClass(key->GetClassName(), cache);
+      if (!cl) {
+        continue;
       }
-      if (todelete) {
-        key->Delete();
-        dir->GetListOfKeys()->Remove(key);
-        delete key;
+      if (cl->InheritsFrom(TDirectory::Class())) {
+        TDirectory *subdir = R__GetSubdir(current, key);
+        if (subdir) {
+          todo.emplace_back(subdir, path + key->GetName() + "/");
+        }
+        continue;
       }
+      if (cl->GetResetAfterMerge()) {
+        continue;
+      }
+      ULong64_t hash = R__HashPayload(file, key, scratch);
+      ++lookups;
+      ULong64_t &last = fHashes[path + key->GetName()];
+      if (fFile && hash && hash == last) {
+        unchanged.push_back(key);
+        savedBytes += key->GetNbytes();
+      }
+      last = hash;
+    }
+    for (auto old : unchanged) {
+      old->Delete();
+      current->GetListOfKeys()->Remove(old);
+      delete old;
+      ++dropped;
     }
   }
+  return dropped;
 }
 
-void TClientInfo::R__MigrateKey(TDirectory *destination, TDirectory *source) {
+// Copy every key of 'source' into 'destination', replacing the previous
+// cycle of the same object, for the whole directory tree; with 'select'
+// only the top-level keys (objects or directories) it names. The old keys
+// are released first so the new ones can reuse their space; the keys
+// appended at the end of the file are then written with one WriteBuffer
+// per contiguous run instead of one per key.
+static void R__MigrateKeys(TDirectory *destination, TDirectory *source, const std::vector<TString> *select) {
   if (destination == 0 || source == 0)
     return;
-  TIter nextkey(source->GetListOfKeys());
-  // std::cout<<"TClientInfo::Trying to migrate the keys here"<<std::endl;
-  TKey *key;
-  while ((key = (TKey *)nextkey())) {
-    TClass *cl = TClass::GetClass(key->GetClassName());
-    if (cl->InheritsFrom(TDirectory::Class())) {
-      TDirectory *source_subdir =
-          (TDirectory *)source->GetList()->FindObject(key->GetName());
-      if (!source_subdir) {
-        source_subdir = (TDirectory *)key->ReadObj();
+  TFile *file = destination->GetFile();
+
+  TClientInfo::ClassCache_t cache;
+  std::vector<std::pair<TDirectory *, TDirectory *>> todo;
+  std::vector<std::pair<TDirectory *, TKey *>> tomigrate;
+  std::vector<TDirectory *> modified;
+  todo.emplace_back(destination, source);
+  while (!todo.empty()) {
+    TDirectory *dst = todo.back().first;
+    TDirectory *src = todo.back().second;
+    todo.pop_back();
+    modified.push_back(dst);
+    TIter nextkey(src->GetListOfKeys());
+    TKey *key;
+    while ((key = (TKey *)nextkey())) {
+      if (TClientInfo::R__IsNTuple(key->GetClassName())) {
+        continue;
       }
-      TDirectory *destination_subdir =
-          destination->GetDirectory(key->GetName());
-      if (!destination_subdir) {
-        destination_subdir = destination->mkdir(key->GetName());
+      if (select && src == source &&
+          std::find(select->begin(), select->end(), TString(key->GetName())) == select->end()) {
+        continue;
       }
-      R__MigrateKey(destination, source);
-    } else {
-      TKey *oldkey = destination->GetKey(key->GetName());
+      TClass *cl = R__GetClass(key->GetClassName(), cache);
+      if (!cl) {
+        // e.g. RNTuple page blobs, only meaningful next to their anchor
+        continue;
+      }
+      if (cl->InheritsFrom(TDirectory::Class())) {
+        TDirectory *source_subdir = R__GetSubdir(src, key);
+        TDirectory *destination_subdir = dst->GetDirectory(key->GetName());
+        if (!destination_subdir) {
+          destination_subdir = dst->mkdir(key->GetName());
+        }
+        if (source_subdir && destination_subdir) {
+          todo.emplace_back(destination_subdir, source_subdir);
+        }
+        continue;
+      }
+      TKey *oldkey = dst->GetKey(key->GetName());
       if (oldkey) {
         oldkey->Delete();
         delete oldkey;
       }
-      TKey *newkey = new TKey(
-          destination, *key,
-          0 /* pidoffset */); // a priori the file are from the same client ..
-      destination->GetFile()->SumBuffer(newkey->GetObjlen());
+      tomigrate.emplace_back(dst, key);
+    }
+  }
+
+  Long64_t end = file->GetEND();
+  std::vector<TKey *> appended;
+  for (auto &migration : tomigrate) {
+    TKey *newkey = new TKey(migration.first, *migration.second,
+                            0 /* pidoffset */); // a priori the file are from the same client ..
+    file->SumBuffer(newkey->GetObjlen());
+    if (newkey->GetSeekKey() >= end) {
+      appended.push_back(newkey);
+    } else {
+      // Placed in a gap left by a deleted key, it may carry the size of
+      // the remaining free segment: let TKey write it.
       newkey->WriteFile(0);
-      if (destination->GetFile()->TestBit(TFile::kWriteError)) {
-        return;
-      }
     }
   }
-  destination->SaveSelf();
+
+  // Keys allocated at the end of the file follow each other.
+  std::vector<char> batch;
+  Long64_t batch_start = 0;
+  for (size_t i = 0; i <= appended.size(); ++i) {
+    TKey *key = i < appended.size() ? appended[i] : 0;
+    Long64_t batch_end = batch_start + (Long64_t)batch.size();
+    if (!batch.empty() && (!key || key->GetSeekKey() != batch_end || batch.size() + key->GetNbytes() > kMaxInt)) {
+      file->Seek(batch_start);
+      file->WriteBuffer(batch.data(), batch.size());
+      batch.clear();
+    }
+    if (!key) {
+      break;
+    }
+    if (batch.empty()) {
+      batch_start = key->GetSeekKey();
+    }
+    const char *start = key->GetBuffer() - key->GetKeylen();
+    batch.insert(batch.end(), start, start + key->GetNbytes());
+    key->DeleteBuffer();
+  }
+  if (file->TestBit(TFile::kWriteError)) {
+    return;
+  }
+  for (auto dir : modified) {
+    dir->SaveSelf();
+  }
+}
+
+void TClientInfo::R__MigrateKey(TDirectory *destination, TDirectory *source) {
+  R__MigrateKeys(destination, source, 0);
+}
+
+void TClientInfo::R__MigrateSelected(TDirectory *destination, TDirectory *source, const std::vector<TString> &select) {
+  R__MigrateKeys(destination, source, &select);
 }
@@ -13,30 +13,68 @@
 #define ROOT_TClientInfo
 
 #include "TFile.h"
+#include "TMemFile.h"
 #include "TTimeStamp.h"
 
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// In-memory input file that can be re-pointed at a new image from the same
+// client. The object, its directory structure and the streamer info read
+// from the first image are reused; only the image bytes and the key list
+// are refreshed.
+class TClientMemFile : public TMemFile {
+
+private:
+  ULong64_t fInfoHash = 0; // of the streamer info record last read
+
+  Bool_t ReadHeader(const char *buffer, Long64_t size);
+  ULong64_t HashStreamerInfo(const char *buffer, Long64_t size) const;
+
+public:
+  TClientMemFile(const char *name, char *buffer, Long64_t size);
+  virtual ~TClientMemFile() {}
+
+  Bool_t Repoint(const char *buffer, Long64_t size);
+  // The image is never written back, there is no free space to track.
+  virtual void MakeFree(Long64_t, Long64_t) {}
+
+  ClassDef(TClientMemFile, 0)
+};
+
 class TClientInfo {
 
 private:
   TFile *fFile;
+  TClientMemFile *fInput; // cached file re-pointed at every new message
   TString fLocalName;
   UInt_t fContactsCount;
   TTimeStamp fLastContact;
   Double_t fTimeSincePrevContact;
+  std::unordered_map<std::string, ULong64_t> fHashes; // payload hash of each non-reset object received
 
 public:
+  using ClassCache_t = std::unordered_map<std::string, TClass *>;
+
   TClientInfo();                                      // default constructor
   TClientInfo(const char *filename, UInt_t clientID); // another constructor
   virtual ~TClientInfo();
 
   TFile *GetFile() const {return fFile;}
+  TClientMemFile *GetInputFile() const {return fInput;}
   TString GetLocalName() const {return fLocalName;}
   Double_t GetTimeSincePrevContact() const {return fTimeSincePrevContact;}
 
+  TFile *OpenInput(const char *name, char *buffer, Long64_t size);
   void SetFile(TFile *file);
+  Int_t DropUnchanged(TDirectory *dir, Long64_t &lookups, Long64_t &savedBytes);
 
-  void R__MigrateKey(TDirectory *destination, TDirectory *source);
-  void R__DeleteObject(TDirectory *dir, Bool_t withReset);
+  static void R__MigrateKey(TDirectory *destination, TDirectory *source);
+  // only the top-level keys (objects or directories) named in 'select'
+  static void R__MigrateSelected(TDirectory *destination, TDirectory *source, const std::vector<TString> &select);
+  static void R__DeleteObject(TDirectory *dir, Bool_t withReset);
+  static Bool_t R__IsNTuple(const char *classname);
 
   ClassDef(TClientInfo, 0);
 };
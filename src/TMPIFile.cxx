@@ -10,18 +10,47 @@
  *************************************************************************/
 
 #include "TMPIFile.h"
+#include "TMPIHistMerge.h"
+#include "TMappedFile.h"
+#include "TBufferFile.h"
+#include "TClass.h"
 #include "TFileCacheWrite.h"
+#include "TH1.h"
 #include "TKey.h"
 #include "TMath.h"
+#include "TROOT.h"
+#include "TStreamerInfo.h"
+#include "TSystem.h"
+#include "TTree.h"
 
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <thread>
 
 ClassImp(TMPIFile);
+ClassImp(TMPIThreadFile);
 
 const Int_t MIN_FILE_NUM = 2;
 
+// Entries of the largest tree of a directory (a worker batch).
+static Long64_t R__CountTreeEntries(TDirectory *dir) {
+  Long64_t entries = 0;
+  TIter next(dir->GetList());
+  TObject *obj;
+  while ((obj = next())) {
+    if (obj->InheritsFrom(TTree::Class())) {
+      entries = TMath::Max(entries, ((TTree *)obj)->GetEntries());
+    }
+  }
+  return entries;
+}
+
 TMPIFile::TMPIFile(const char *name, char *buffer, Long64_t size,
                    Option_t *option, Int_t split, const char *ftitle,
                    Int_t compress)
@@ -39,8 +68,30 @@ TMPIFile::TMPIFile(const char *name, Option_t *option, Int_t split,
   SplitMPIComm();
 }
 
+TMPIFile::TMPIFile(const char *name, TMPILocalGroup *group, Int_t rank,
+                   Option_t *option, const char *ftitle, Int_t compress)
+    : TMemFile(name, option, ftitle, compress), argc(0), fSplitLevel(1), fMPIColor(0), fRequest(0), argv(0), fSendBuf(0)
+{
+  if (!group || rank < 0 || rank >= group->GetSize()) {
+    SysError("TMPIFile", "rank %d is not part of the in-process group", rank);
+    exit(1);
+  }
+  fLocal = group;
+  fMPIGlobalRank = fMPILocalRank = rank;
+  fMPIGlobalSize = fMPILocalSize = group->GetSize();
+  sub_comm = MPI_COMM_NULL;
+}
+
 TMPIFile::~TMPIFile() {
+  StopSender();
+#ifdef TMPI_RNTUPLE
+  // The writer commits into this file, it has to go before Close().
+  fNTupleWriter.reset();
+#endif
   Close();
+  fMergers.Delete();
+  // only left without MPIClose(), and freeing it is collective as well
+  delete fWindow;
   if (fSplitLevel > 1) {
     MPI_Comm_free(&sub_comm);
   }
@@ -51,113 +102,895 @@ void TMPIFile::UpdateEndProcess()
   fEndProcess++;
 }
 
+// Write the merged output through a TMappedFile growing by 'extent' bytes
+// instead of a regular TFile. Must be called before RunCollector().
+void TMPIFile::SetMMapOutput(Bool_t enable, Long64_t extent)
+{
+  if (!enable) {
+    fMMapExtent = 0;
+  } else {
+    fMMapExtent = extent > 0 ? extent : TMappedFile::kDefaultExtent;
+  }
+}
+
 void TMPIFile::RunCollector(Bool_t cache) {
+  StartCollector(cache);
+  FinishCollector();
+}
+
+// Non-blocking collector: StartCollector() once, then Progress() as often
+// as possible in between the collector's own work, and FinishCollector()
+// (or MPIClose()) at the end. Sync() on a collector merges its own batch.
+void TMPIFile::StartCollector(Bool_t cache) {
+  if (!this->IsCollector()) {
+    SysError("StartCollector", " should not be called by a worker");
+    exit(1);
+  }
   this->SetOutputName();
-  THashTable mergers;
-  
-  Int_t client_Id = 0;
-  Int_t msg_received = 0;
-  
-  auto run_start = std::chrono::high_resolution_clock::now();
+  fCache = cache;
+  fCollecting = kTRUE;
+  fRunStart = std::chrono::high_resolution_clock::now();
 
   std::cout << "CCT run time\t probe time\t merge time\t buffer size (MB)\t "
                "megabytes per second\t messages per second\t merge counter\t "
                "while time\n";
+}
+
+// Handle the messages already received, without blocking, at most
+// 'maxMessages' of them (0 for all) so that a steady flow of messages
+// cannot starve the collector's own work. Returns false once every worker
+// has sent its end of job.
+Bool_t TMPIFile::Progress(Int_t maxMessages) {
+  if (!fCollecting) {
+    return kFALSE;
+  }
+  Int_t handled = 0;
+  while (fEndProcess != fMPILocalSize - 1) {
+    if (maxMessages > 0 && handled == maxMessages) {
+      return kTRUE;
+    }
+    handled++;
+    if (fScheduled) {
+      ReceivePending(kFALSE);
+      if (!MergePending()) {
+        return kTRUE;
+      }
+      continue;
+    }
+    if (fLocal || fWindow) {
+      auto probe_start = std::chrono::high_resolution_clock::now();
+      if (!(fLocal ? PollLocal(probe_start) : PollWindow(probe_start))) {
+        return kTRUE;
+      }
+      continue;
+    }
+    Int_t flag;
+    MPI_Status status;
+    auto probe_start = std::chrono::high_resolution_clock::now();
+    MPI_Iprobe(MPI_ANY_SOURCE, fMessageTag, sub_comm, &flag, &status);
+    auto probe_end = std::chrono::high_resolution_clock::now();
+    if (!flag) {
+      return kTRUE;
+    }
+    ReceiveMessage(status, std::chrono::duration_cast<std::chrono::duration<double>>(
+                               probe_end - probe_start).count());
+  }
+  return kFALSE;
+}
 
+// Block until every worker has sent its end of job, then write the output.
+void TMPIFile::FinishCollector() {
+  if (!fCollecting) {
+    return;
+  }
   while (fEndProcess != fMPILocalSize - 1) {
 
+    if (fScheduled) {
+      // take in whatever has arrived, waiting only with nothing to merge
+      ReceivePending(fPendingCount == 0);
+      MergePending();
+      continue;
+    }
+
     // check if message has been received
+    auto probe_start = std::chrono::high_resolution_clock::now();
+    if (fLocal) {
+      while (!PollLocal(probe_start)) {
+        std::this_thread::yield();
+      }
+      continue;
+    }
+    if (fWindow) {
+      while (!PollWindow(probe_start)) {
+        std::this_thread::yield();
+      }
+      continue;
+    }
     MPI_Status status;
+    MPI_Probe(MPI_ANY_SOURCE, fMessageTag, sub_comm, &status);
+    auto probe_end = std::chrono::high_resolution_clock::now();
+    ReceiveMessage(status, std::chrono::duration_cast<std::chrono::duration<double>>(
+                               probe_end - probe_start).count());
+  }
+
+  FlushMergers();
+  fMergers.Delete();
+  for (auto &spool : fSpools) {
+    Error("FinishCollector", "image streamed by worker %d is incomplete, dropped", spool.first);
+    spool.second.fOut.reset();
+    gSystem->Unlink(spool.second.fName);
+  }
+  fSpools.clear();
+  for (auto &name : fSpoolFiles) {
+    gSystem->Unlink(name);
+  }
+  fSpoolFiles.clear();
+  if (fCheckpointInterval > 0) {
+    WriteCheckpointState();
+  }
+  fCollecting = kFALSE;
+  auto run_end = std::chrono::high_resolution_clock::now();
+  fMetrics.Fill("run_time", std::chrono::duration_cast<std::chrono::duration<double>>(
+                                run_end - fRunStart).count());
+}
+
+// Receive the probed message and act on it.
+void TMPIFile::ReceiveMessage(MPI_Status &status, double probe_time) {
+  // get bytes received
+  Int_t count;
+  MPI_Get_count(&status, MPI_CHAR, &count);
+  Int_t number_bytes = sizeof(char) * count;
+
+  // take a buffer from the pool to receive message
+  char *buf = fBufferPool.Acquire(number_bytes);
+  MPI_Recv(buf, number_bytes, MPI_CHAR, status.MPI_SOURCE, status.MPI_TAG, sub_comm,
+           MPI_STATUS_IGNORE);
+  HandleMessage(status.MPI_SOURCE, buf, number_bytes, probe_time);
+  fBufferPool.Release(buf);
+}
+
+// Merge the workers' messages in the order of 'policy' instead of their
+// arrival: the collector receives everything available (up to
+// 'maxPendingBytes', 0 for no limit) into per-worker queues and picks the
+// next message among their heads. Must be called before StartCollector().
+void TMPIFile::SetMergePolicy(EMergePolicy policy, Long64_t maxPendingBytes)
+{
+  fScheduled = kTRUE;
+  fMergePolicy = policy;
+  fMaxPendingBytes = maxPendingBytes;
+}
+
+// Sum the histograms that have the same binning in every client with
+// vectorized adds of their bin arrays (TMPIHistMerge) rather than
+// TH1::Merge; on by default.
+void TMPIFile::SetFastHistogramMerge(Bool_t enable)
+{
+  fFastHistMerge = enable;
+}
+
+void TMPIFile::AddStream(const char *stream, const char *keys, Int_t mergeEvery)
+{
+  if (fCollecting) {
+    SysError("AddStream", " has to be called before StartCollector()");
+    exit(1);
+  }
+  if (!stream || !*stream || !keys || !*keys) {
+    Error("AddStream", "a stream needs a name and the keys routed to it");
+    return;
+  }
+  auto it = std::find_if(fStreams.begin(), fStreams.end(),
+                         [stream](const Stream &s) { return s.fName == stream; });
+  if (it == fStreams.end()) {
+    fStreams.push_back(Stream());
+    it = fStreams.end() - 1;
+    it->fName = stream;
+  }
+  it->fPatterns.push_back(TRegexp(keys, kTRUE));
+  it->fMergeEvery = mergeEvery > 0 ? mergeEvery : 1;
+  // the stream parts of the received messages go ahead of the main merges,
+  // the policy and pending-bytes limit stay those of SetMergePolicy()
+  fScheduled = kTRUE;
+}
+
+// Full merges of the main output at most every 'mergeEvery' messages.
+void TMPIFile::SetMergeCadence(Int_t mergeEvery)
+{
+  fMergeEvery = mergeEvery > 0 ? mergeEvery : 1;
+}
+
+// Hash the objects that are not reset after a merge (histograms, metadata)
+// as they come in, and leave out of the merge those a client sends again
+// unchanged: its file keeps the previous copy. A buffer whose objects are
+// all unchanged skips the full merge.
+void TMPIFile::SetKeyDeduplication(Bool_t enable)
+{
+  fDedup = enable;
+}
+
+// Receive the messages available into the pending queues, blocking for the
+// first one with 'block'. Returns true if any was received.
+Bool_t TMPIFile::ReceivePending(Bool_t block) {
+  Bool_t received = kFALSE;
+  while (fMaxPendingBytes <= 0 || fPendingBytes < fMaxPendingBytes || (block && !received)) {
+    Bool_t wait = block && !received;
+    Int_t source, tag, number_bytes;
+    char *slot = 0;
     auto probe_start = std::chrono::high_resolution_clock::now();
-    MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, sub_comm, &status);
+    if (fLocal) {
+      Bool_t found;
+      while (!(found = PopLocal(source, slot, number_bytes)) && wait) {
+        std::this_thread::yield();
+      }
+      if (!found) {
+        break;
+      }
+      tag = fMessageTag;
+    } else if (fWindow) {
+      Bool_t found;
+      while (!(found = fWindow->Poll(source, tag, slot, number_bytes)) && wait) {
+        std::this_thread::yield();
+      }
+      if (!found) {
+        break;
+      }
+    } else {
+      MPI_Status status;
+      Int_t flag = 1;
+      if (wait) {
+        MPI_Probe(MPI_ANY_SOURCE, fMessageTag, sub_comm, &status);
+      } else {
+        MPI_Iprobe(MPI_ANY_SOURCE, fMessageTag, sub_comm, &flag, &status);
+      }
+      if (!flag) {
+        break;
+      }
+      source = status.MPI_SOURCE;
+      tag = status.MPI_TAG;
+      MPI_Get_count(&status, MPI_CHAR, &number_bytes);
+    }
     auto probe_end = std::chrono::high_resolution_clock::now();
-    double probe_time =
-        std::chrono::duration_cast<std::chrono::duration<double>>(probe_end -
-                                                                  probe_start)
-            .count();
-    std::stringstream timing_msg;
-
-    auto while_start = std::chrono::high_resolution_clock::now();
-    double run_time = std::chrono::duration_cast<std::chrono::duration<double>>(
-                          while_start - run_start)
-                          .count();
-    timing_msg << "CCT " << run_time << "\t" << probe_time;
-
-    // get bytes received
-    Int_t count;
-    MPI_Get_count(&status, MPI_CHAR, &count);
-    Int_t number_bytes = sizeof(char) * count;
-
-    // create buffer to receive message
-    char *buf = new char[number_bytes];
-    Int_t source = status.MPI_SOURCE;
-    Int_t tag = status.MPI_TAG;
-
-    if (number_bytes == 0) {
-      // empty buffer is a worker's last send request....
+
+    PendingMessage msg;
+    msg.fBuf = fBufferPool.Acquire(number_bytes);
+    msg.fBytes = number_bytes;
+    msg.fOrder = fArrivals++;
+    msg.fProbeTime = std::chrono::duration_cast<std::chrono::duration<double>>(probe_end - probe_start).count();
+    msg.fStreamed = kFALSE;
+    if (slot) {
+      // the slot goes back to the workers right away
+      memcpy(msg.fBuf, slot, number_bytes);
+    } else {
+      MPI_Recv(msg.fBuf, number_bytes, MPI_CHAR, source, tag, sub_comm, MPI_STATUS_IGNORE);
+    }
+    if (fLocal) {
+      ReturnLocal(source, slot, number_bytes);
+    } else if (fWindow) {
+      fWindow->Release();
+    }
+    msg.fReceived = std::chrono::high_resolution_clock::now();
+    fPending[source].push_back(msg);
+    fPendingBytes += number_bytes;
+    fPendingCount++;
+    received = kTRUE;
+  }
+  return received;
+}
+
+// Merge the pending message the policy picks among the workers' oldest
+// ones. Returns false if there is none.
+Bool_t TMPIFile::MergePending() {
+  if (fPendingCount == 0) {
+    return kFALSE;
+  }
+  StreamPending();
+  auto pick = fPending.end();
+  for (auto it = fPending.begin(); it != fPending.end(); ++it) {
+    if (it->second.empty()) {
+      continue;
+    }
+    if (pick == fPending.end()) {
+      pick = it;
+      continue;
+    }
+    const PendingMessage &head = it->second.front();
+    const PendingMessage &best = pick->second.front();
+    Bool_t better = kFALSE;
+    switch (fMergePolicy) {
+    case kFIFO:
+      better = head.fOrder < best.fOrder;
+      break;
+    case kSmallestFirst:
+      better = head.fBytes < best.fBytes || (head.fBytes == best.fBytes && head.fOrder < best.fOrder);
+      break;
+    case kLeastRecent: {
+      auto served = fLastServed.find(it->first);
+      auto bestServed = fLastServed.find(pick->first);
+      Long64_t last = served == fLastServed.end() ? -1 : served->second;
+      Long64_t bestLast = bestServed == fLastServed.end() ? -1 : bestServed->second;
+      better = last < bestLast || (last == bestLast && head.fOrder < best.fOrder);
+      break;
+    }
+    case kRoundRobin:
+      // first rank after the last one served, wrapping around
+      better = (pick->first <= fLastSource && it->first > fLastSource);
+      break;
+    }
+    if (better) {
+      pick = it;
+    }
+  }
+
+  Int_t source = pick->first;
+  PendingMessage msg = pick->second.front();
+  pick->second.pop_front();
+  fPendingBytes -= msg.fBytes;
+  fPendingCount--;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  double queue_time = std::chrono::duration_cast<std::chrono::duration<double>>(start - msg.fReceived).count();
+  fMetrics.Fill("queue_time", queue_time);
+  TString name;
+  name.Form("queue_time_worker%d", source);
+  fMetrics.Fill(name, queue_time);
+
+  fSkipStreams = msg.fStreamed;
+  HandleMessage(source, msg.fBuf, msg.fBytes, msg.fProbeTime);
+  fSkipStreams = kFALSE;
+  fBufferPool.Release(msg.fBuf);
+  fLastServed[source] = fServed++;
+  fLastSource = source;
+  return kTRUE;
+}
+
+// Merge the stream parts of the pending images ahead of the main merges of
+// the messages before them, so that a stream does not wait behind the tree
+// merges. Only the plain images that HandleMessage() will accept are
+// streamed ahead: a worker's queue is followed up to its first other
+// message, the chunks and multipart messages keep their streams inline.
+// A checkpoint only accounts for the messages merged in full, nothing is
+// streamed ahead with checkpoints on.
+void TMPIFile::StreamPending() {
+  if (fStreams.empty() || fCheckpointInterval > 0) {
+    return;
+  }
+  for (auto &queue : fPending) {
+    Int_t source = queue.first;
+    Long64_t next = fNextSeq[source];
+    for (auto &msg : queue.second) {
+      TMPIMessageHeader header;
+      if (msg.fBytes < (Int_t)sizeof(header)) {
+        break;
+      }
+      memcpy(&header, msg.fBuf, sizeof(header));
+      if (header.fMagic != TMPIMessageHeader::kMagic || header.fWorker != source ||
+          header.fBytes != msg.fBytes - (Int_t)sizeof(header) || header.fFlags || header.fSeq < next ||
+          (header.fSchemaId && header.fSchemaId != fClientSchema[source])) {
+        break;
+      }
+      next = header.fSeq + 1;
+      if (msg.fStreamed) {
+        continue;
+      }
+      auto start = std::chrono::high_resolution_clock::now();
+      // a read-only view of the pending buffer, the image is not copied
+      TMemFile view(fMPIFilename, TMemFile::ZeroCopyView_t(msg.fBuf + sizeof(header), header.fBytes));
+      if (view.IsZombie()) {
+        // left to the main merge, which reports it
+        break;
+      }
+      for (auto &stream : fStreams) {
+        TFile *part = SplitStream(stream, &view, kTRUE, kFALSE);
+        if (part) {
+          MergeInput(GetMerger(stream.fOutput, stream.fMergeEvery), ClientId(source), part);
+          auto stream_end = std::chrono::high_resolution_clock::now();
+          fMetrics.Fill(("stream_time_" + stream.fName).Data(),
+                        std::chrono::duration_cast<std::chrono::duration<double>>(stream_end - start).count());
+        }
+      }
+      msg.fStreamed = kTRUE;
+      fMetrics.Add("messages_streamed_ahead");
+    }
+  }
+}
+
+// In-process mode: take the next message of the workers' rings, polled in
+// turn so that none is starved.
+Bool_t TMPIFile::PopLocal(Int_t &source, char *&buf, Int_t &count) {
+  Int_t nworkers = fMPILocalSize - 1;
+  for (Int_t i = 0; i < nworkers; i++) {
+    Int_t rank = 1 + (fLocalNext + i) % nworkers;
+    if (fLocal->ToCollector(rank).Pop(buf, count)) {
+      source = rank;
+      fLocalNext = rank % nworkers;
+      return kTRUE;
+    }
+  }
+  return kFALSE;
+}
+
+// Hand a consumed buffer back to the worker's pool. The ring has room for
+// every message the worker can have in flight.
+void TMPIFile::ReturnLocal(Int_t source, char *buf, Int_t count) {
+  while (!fLocal->ToWorker(source).Push(buf, count)) {
+    std::this_thread::yield();
+  }
+}
+
+// Act on the next message of the workers' rings, merged straight from the
+// worker's buffer.
+Bool_t TMPIFile::PollLocal(std::chrono::high_resolution_clock::time_point probe_start) {
+  Int_t source, number_bytes;
+  char *buf;
+  if (!PopLocal(source, buf, number_bytes)) {
+    return kFALSE;
+  }
+  auto probe_end = std::chrono::high_resolution_clock::now();
+  HandleMessage(source, buf, number_bytes,
+                std::chrono::duration_cast<std::chrono::duration<double>>(probe_end - probe_start).count());
+  ReturnLocal(source, buf, number_bytes);
+  return kTRUE;
+}
+
+// Act on the next message of the RMA window, if it has arrived. It is
+// merged straight from its slot, which is handed back to the workers
+// afterwards.
+Bool_t TMPIFile::PollWindow(std::chrono::high_resolution_clock::time_point probe_start) {
+  Int_t source, tag, number_bytes;
+  char *buf;
+  if (!fWindow->Poll(source, tag, buf, number_bytes)) {
+    return kFALSE;
+  }
+  auto probe_end = std::chrono::high_resolution_clock::now();
+  double probe_time = std::chrono::duration_cast<std::chrono::duration<double>>(
+                          probe_end - probe_start).count();
+  if (buf) {
+    HandleMessage(source, buf, number_bytes, probe_time);
+  } else {
+    // larger than a slot, the payload follows as a regular message
+    buf = fBufferPool.Acquire(number_bytes);
+    MPI_Recv(buf, number_bytes, MPI_CHAR, source, tag, sub_comm, MPI_STATUS_IGNORE);
+    HandleMessage(source, buf, number_bytes, probe_time);
+    fBufferPool.Release(buf);
+  }
+  fWindow->Release();
+  return kTRUE;
+}
+
+void TMPIFile::HandleMessage(Int_t source, char *buf, Int_t number_bytes, double probe_time) {
+  fMetrics.Fill("probe_time", probe_time);
+  std::stringstream timing_msg;
+
+  auto while_start = std::chrono::high_resolution_clock::now();
+  double run_time = std::chrono::duration_cast<std::chrono::duration<double>>(
+                        while_start - fRunStart)
+                        .count();
+  timing_msg << "CCT " << run_time << "\t" << probe_time;
+
+  TMPIMessageHeader header;
+  if (number_bytes >= (Int_t)sizeof(header)) {
+    memcpy(&header, buf, sizeof(header));
+  }
+  if (number_bytes < (Int_t)sizeof(header) || header.fMagic != TMPIMessageHeader::kMagic ||
+      header.fWorker != source || header.fBytes != number_bytes - (Int_t)sizeof(header)) {
+    Error("HandleMessage", "malformed message of %d bytes from worker %d dropped", number_bytes, source);
+    fMetrics.Add("messages_malformed");
+  } else if (CheckSequence(source, header)) {
+    char *payload = buf + sizeof(header);
+    if (!(header.fFlags & (TMPIMessageHeader::kEndOfJob | TMPIMessageHeader::kSchema)) && header.fSchemaId &&
+        header.fSchemaId != fClientSchema[source]) {
+      // its streamer infos were left out and never registered
+      Error("HandleMessage", "buffer of worker %d relies on the unregistered schema %u, dropped", source,
+            header.fSchemaId);
+      fMetrics.Add("messages_schema_unknown");
+    } else if (header.fFlags & TMPIMessageHeader::kEndOfJob) {
       this->UpdateEndProcess();
-      MPI_Recv(buf, number_bytes, MPI_CHAR, source, tag, sub_comm,
-               MPI_STATUS_IGNORE);
+    } else if (header.fFlags & TMPIMessageHeader::kSchema) {
+      // streamer infos a worker will leave out of its buffers from now on
+      if (RegisterSchema(source, payload, header.fBytes)) {
+        TIter next(&fMergers);
+        ParallelFileMerger *merger;
+        while ((merger = (ParallelFileMerger *)next())) {
+          InjectSchema(merger->fMerger.GetOutputFile());
+        }
+      }
+    } else if (header.fFlags & TMPIMessageHeader::kChunk) {
+      fMetrics.Add("entries_received", header.fEntries);
+      AppendChunk(source, header, payload, timing_msg);
+    } else if (header.fFlags & TMPIMessageHeader::kMultipart) {
+      fMetrics.Add("entries_received", header.fEntries);
+      MergeParts(source, payload, header.fBytes, timing_msg);
     } else {
+      fMetrics.Add("entries_received", header.fEntries);
+      MergeBuffer(ClientId(source), payload, header.fBytes, timing_msg);
+    }
+  }
 
-      MPI_Recv(buf, number_bytes, MPI_CHAR, source, tag, sub_comm,
-               MPI_STATUS_IGNORE);
+  auto while_end = std::chrono::high_resolution_clock::now();
+  double while_time =
+      std::chrono::duration_cast<std::chrono::duration<double>>(while_end -
+                                                                while_start)
+          .count();
+  timing_msg << while_time << std::endl;
+  fMetrics.Fill("while_time", while_time);
+  if (timing_msg.str().size() > 40)
+    std::cout << timing_msg.str();
+}
+
+// The merger client of a worker rank, or of one of its thread files, whose
+// latest image holds the current state of its non-resettable objects.
+UInt_t TMPIFile::ClientId(Int_t source, Int_t thread) const {
+  return UInt_t(thread + 1) * fMPILocalSize + source;
+}
 
-      auto merge_start = std::chrono::high_resolution_clock::now();
-      msg_received++;
+// Merge one file image, received from a worker or produced by the
+// collector's own Sync(), into the output. A streamed image is merged from
+// its 'spool' file instead of a buffer.
+void TMPIFile::MergeBuffer(UInt_t client, char *buf, Long64_t number_bytes, std::stringstream &timing_msg,
+                           const char *spool) {
+  auto merge_start = std::chrono::high_resolution_clock::now();
+  fMsgReceived++;
 
-      TMemFile *infile = new TMemFile(fMPIFilename, buf, number_bytes, "UPDATE");
-      if (infile->IsZombie()) {
-        exit(1);
+  ParallelFileMerger *info = GetMerger(fMPIFilename, fMergeEvery);
+  UInt_t nclients = info->fClients.size();
+  info->GetClient(client);
+  if (info->fClients.size() > nclients) {
+    fMetrics.Add("clients_registered");
+  }
+  TFile *infile = spool ? TFile::Open(spool, "UPDATE") : info->OpenClientFile(client, buf, number_bytes);
+  if (!infile || infile->IsZombie()) {
+    // losing one batch is better than losing the whole output
+    Error("MergeBuffer", "cannot open a buffer of %lld bytes, dropped", number_bytes);
+    fMetrics.Add("messages_dropped");
+    if (spool) {
+      delete infile;
+      gSystem->Unlink(spool);
+    }
+    return;
+  }
+  infile->SetCompressionSettings(this->GetCompressionSettings());
+
+  // The streams first, their outputs do not wait for the rest. Merged
+  // already when the message was pending, their keys are only dropped.
+  for (auto &stream : fStreams) {
+    TFile *part = SplitStream(stream, infile, !fSkipStreams);
+    if (part) {
+      MergeInput(GetMerger(stream.fOutput, stream.fMergeEvery), client, part);
+      auto stream_end = std::chrono::high_resolution_clock::now();
+      fMetrics.Fill(("stream_time_" + stream.fName).Data(),
+                    std::chrono::duration_cast<std::chrono::duration<double>>(stream_end - merge_start).count());
+    }
+  }
+  MergeInput(info, client, infile, spool);
+  infile = 0;
+
+  auto merge_end = std::chrono::high_resolution_clock::now();
+
+  double merge_time =
+      std::chrono::duration_cast<std::chrono::duration<double>>(merge_end -
+                                                                merge_start)
+          .count();
+  double run_time = std::chrono::duration_cast<std::chrono::duration<double>>(
+                        merge_end - fRunStart)
+                        .count();
+  double megabytes_per_second = number_bytes / merge_time / 1024. / 1024.;
+  double messages_per_second = fMsgReceived / run_time;
+  fMetrics.Fill("merge_time", merge_time);
+  fMetrics.Fill("message_size", number_bytes);
+  fMetrics.Add("messages_received");
+  fMetrics.Add("bytes_received", number_bytes);
+  timing_msg << "\t " << merge_time << "\t "
+             << (float(number_bytes) / 1024. / 1024.) << "\t "
+             << megabytes_per_second << "\t " << messages_per_second
+             << "\t " << fMsgReceived << "\t ";
+
+  if (fCheckpointInterval > 0 &&
+      std::chrono::duration_cast<std::chrono::duration<double>>(merge_end - fLastCheckpoint).count() >
+          fCheckpointInterval) {
+    Checkpoint();
+  }
+}
+
+// Merge the file of a client into the output of 'info': its trees and
+// RNTuples are appended at once, its other objects are merged again from
+// all the client files when they changed, at the cadence of the merger.
+void TMPIFile::MergeInput(ParallelFileMerger *info, UInt_t client, TFile *infile, const char *spool) {
+  // The first file of a client stays its file, a spooled one on disk until
+  // the end; the keys of the following ones are migrated to it.
+  Bool_t migrated = info->GetClient(client).GetFile() != 0;
+
+  info->NTupleMerge(infile);
+  if (R__NeedInitialMerge(infile)) {
+    info->InitialMerge(infile);
+  }
+
+  // Non-resettable objects are all merged again from the client files, only
+  // needed when this buffer brings new ones.
+  Bool_t needMerge = R__NeedMerge(infile);
+  if (fDedup && needMerge) {
+    Long64_t lookups = 0;
+    Long64_t saved = 0;
+    Int_t hits = info->GetClient(client).DropUnchanged(infile, lookups, saved);
+    fMetrics.Add("dedup_lookups", lookups);
+    fMetrics.Add("dedup_hits", hits);
+    fMetrics.Add("dedup_bytes_saved", saved);
+    if (hits && !R__NeedMerge(infile)) {
+      // estimated by the mean time of the full merges so far
+      needMerge = kFALSE;
+      fMetrics.Add("merges_deduplicated");
+      if (fFullMerges) {
+        fMetrics.Fill("merge_time_saved", fFullMergeTime / fFullMerges);
       }
-      infile->SetCompressionSettings(this->GetCompressionSettings());
+    }
+  }
+  info->RegisterClient(client, infile);
+  if (spool) {
+    if (migrated) {
+      gSystem->Unlink(spool);
+    } else {
+      fSpoolFiles.push_back(spool);
+    }
+  }
+  info->fStale = info->fStale || needMerge;
+  info->fSinceMerge++;
+  if (info->fStale && info->fSinceMerge >= info->fMergeEvery) {
+    FullMerge(info);
+  } else if (info->fStale) {
+    fMetrics.Add("merges_deferred");
+  } else {
+    fMetrics.Add("merges_skipped");
+  }
+}
+
+void TMPIFile::FullMerge(ParallelFileMerger *info) {
+  auto full_start = std::chrono::high_resolution_clock::now();
+  info->Merge();
+  auto full_end = std::chrono::high_resolution_clock::now();
+  fMetrics.Add("hists_fast_merged", info->fLastFastMerged);
+  fFullMerges++;
+  fFullMergeTime += std::chrono::duration_cast<std::chrono::duration<double>>(full_end - full_start).count();
+  info->fStale = kFALSE;
+  info->fSinceMerge = 0;
+}
+
+// Bring every output up to date with the objects its cadence has deferred.
+void TMPIFile::FlushMergers() {
+  TIter next(&fMergers);
+  ParallelFileMerger *merger;
+  while ((merger = (ParallelFileMerger *)next())) {
+    if (merger->fStale) {
+      FullMerge(merger);
+    }
+  }
+}
+
+TMPIFile::ParallelFileMerger *TMPIFile::GetMerger(const TString &output, Int_t mergeEvery) {
+  ParallelFileMerger *info = (ParallelFileMerger *)fMergers.FindObject(output);
+  if (!info) {
+    info = new ParallelFileMerger(output, this->GetCompressionSettings(), fCache, fMMapExtent, fRestart);
+    info->fFastHistMerge = fFastHistMerge;
+    info->fMergeEvery = mergeEvery;
+    InjectSchema(info->fMerger.GetOutputFile());
+    fMergers.Add(info);
+  }
+  return info;
+}
 
-      ParallelFileMerger *info = (ParallelFileMerger *)mergers.FindObject(fMPIFilename);
-      if (!info) {
-        info = new ParallelFileMerger(fMPIFilename, this->GetCompressionSettings(), cache);
-        mergers.Add(info);
+// Move the top-level keys of 'input' routed to 'stream' to a new in-memory
+// file, 0 if there are none. RNTuples, addressed by offset in their file,
+// stay in the main output. Without 'copy' the keys are only deleted from
+// 'input', without 'remove' they are only copied.
+TFile *TMPIFile::SplitStream(const Stream &stream, TFile *input, Bool_t copy, Bool_t remove) {
+  std::vector<TString> names;
+  std::vector<TKey *> keys;
+  TIter nextkey(input->GetListOfKeys());
+  TKey *key;
+  while ((key = (TKey *)nextkey())) {
+    if (TClientInfo::R__IsNTuple(key->GetClassName()) || !TClass::GetClass(key->GetClassName())) {
+      continue;
+    }
+    TString name = key->GetName();
+    for (auto &pattern : stream.fPatterns) {
+      Ssiz_t len = 0;
+      if (pattern.Index(name, &len) == 0 && len == name.Length()) {
+        if (std::find(names.begin(), names.end(), name) == names.end()) {
+          names.push_back(name);
+        }
+        keys.push_back(key);
+        break;
       }
-      if (R__NeedInitialMerge(infile)) {
-        info->InitialMerge(infile);
+    }
+  }
+  if (keys.empty()) {
+    return 0;
+  }
+  TMemFile *part = 0;
+  if (copy) {
+    part = new TMemFile(stream.fOutput, "RECREATE", "", this->GetCompressionSettings());
+    TClientInfo::R__MigrateSelected(part, input, names);
+    for (auto &name : names) {
+      // a directory was read to be migrated
+      TObject *obj = input->GetList()->FindObject(name);
+      if (obj) {
+        input->GetList()->Remove(obj);
+        delete obj;
       }
+    }
+  }
+  if (!remove) {
+    return part;
+  }
+  for (auto moved : keys) {
+    moved->Delete();
+    input->GetListOfKeys()->Remove(moved);
+    delete moved;
+  }
+  return part;
+}
 
-      info->RegisterClient(client_Id, infile);
-      info->Merge();
-      infile = 0;
+// Write a segment of a streamed image to its spool file, next to the output;
+// the last one closes it and merges it from there. Only a segment at a time
+// is held in memory.
+void TMPIFile::AppendChunk(Int_t source, const TMPIMessageHeader &header, char *payload, std::stringstream &timing_msg) {
+  auto it = fSpools.find(source);
+  if (it == fSpools.end()) {
+    SpoolFile &spool = fSpools[source];
+    spool.fName.Form("%s.spool-%d-%d", fMPIFilename.Data(), source, gSystem->GetPid());
+    spool.fOut.reset(new std::ofstream(spool.fName.Data(), std::ios::binary | std::ios::trunc));
+    spool.fFirstSeq = header.fSeq;
+    spool.fNextSeq = header.fSeq;
+    spool.fBytes = 0;
+    spool.fBroken = !*spool.fOut;
+    if (spool.fBroken) {
+      Error("AppendChunk", "cannot create %s", spool.fName.Data());
+    }
+    it = fSpools.find(source);
+  }
+  SpoolFile &spool = it->second;
+  if (header.fSeq != spool.fNextSeq) {
+    spool.fBroken = kTRUE;
+  }
+  spool.fNextSeq = header.fSeq + 1;
+  if (!spool.fBroken) {
+    spool.fOut->write(payload, header.fBytes);
+    spool.fBytes += header.fBytes;
+    spool.fBroken = !*spool.fOut;
+  }
+  fMetrics.Add("chunks_received");
+  if (!(header.fFlags & TMPIMessageHeader::kLastChunk)) {
+    return;
+  }
+
+  spool.fOut->close();
+  TString name = spool.fName;
+  Long64_t bytes = spool.fBytes;
+  Bool_t broken = spool.fBroken || !*spool.fOut;
+  fSpools.erase(it);
+  if (broken) {
+    Error("AppendChunk", "image streamed by worker %d is incomplete, dropped", source);
+    fMetrics.Add("messages_dropped");
+    gSystem->Unlink(name);
+    return;
+  }
+  fMetrics.Add("images_spooled");
+  if (header.fThread < -1 || header.fThread >= kMaxInt / fMPILocalSize) {
+    Error("AppendChunk", "image streamed by worker %d names thread file %d, dropped", source, header.fThread);
+    fMetrics.Add("messages_malformed");
+    gSystem->Unlink(name);
+    return;
+  }
+  MergeBuffer(ClientId(source, header.fThread), 0, bytes, timing_msg, name);
+}
 
-      auto merge_end = std::chrono::high_resolution_clock::now();
+// Make the output readable as it is now: keys, streamer infos, free
+// segments and header written and flushed, then record the messages it
+// contains. Its cost is bounded by the checkpoint interval.
+void TMPIFile::Checkpoint() {
+  auto start = std::chrono::high_resolution_clock::now();
+  FlushMergers();
+  TIter next(&fMergers);
+  ParallelFileMerger *merger;
+  while ((merger = (ParallelFileMerger *)next())) {
+    TFile *output = merger->fMerger.GetOutputFile();
+    output->Write(0, TObject::kOverwrite);
+    output->Flush();
+  }
+  WriteCheckpointState();
+  fLastCheckpoint = std::chrono::high_resolution_clock::now();
+  fMetrics.Fill("checkpoint_time", std::chrono::duration_cast<std::chrono::duration<double>>(
+                                       fLastCheckpoint - start).count());
+  fMetrics.Add("checkpoints");
+}
+
+TString TMPIFile::GetCheckpointName() const {
+  return fMPIFilename + ".checkpoint";
+}
 
-      double merge_time =
-          std::chrono::duration_cast<std::chrono::duration<double>>(merge_end -
-                                                                    merge_start)
-              .count();
-      run_time = std::chrono::duration_cast<std::chrono::duration<double>>(
-                     merge_end - run_start)
-                     .count();
-      double megabytes_per_second = number_bytes / merge_time / 1024. / 1024.;
-      double messages_per_second = msg_received / run_time;
-      timing_msg << "\t " << merge_time << "\t "
-                 << (float(number_bytes) / 1024. / 1024.) << "\t "
-                 << megabytes_per_second << "\t " << messages_per_second
-                 << "\t " << msg_received << "\t ";
-      client_Id++;
+// One "<worker rank> <next message>" line per worker. Written aside and
+// renamed so that a crash leaves either the previous state or this one.
+void TMPIFile::WriteCheckpointState() {
+  TString name = GetCheckpointName();
+  TString tmpname = name + ".tmp";
+  {
+    std::ofstream out(tmpname.Data());
+    for (auto &seq : fNextSeq) {
+      // a worker in the middle of a streamed image sends it again
+      auto spool = fSpools.find(seq.first);
+      out << seq.first << " " << (spool != fSpools.end() ? spool->second.fFirstSeq : seq.second) << "\n";
     }
-    delete [] buf;
+    if (!out) {
+      Error("Checkpoint", "cannot write %s", tmpname.Data());
+      return;
+    }
+  }
+  if (std::rename(tmpname.Data(), name.Data()) != 0) {
+    SysError("Checkpoint", "cannot rename %s to %s", tmpname.Data(), name.Data());
+  }
+}
+
+Bool_t TMPIFile::ReadCheckpointState() {
+  std::ifstream in(GetCheckpointName().Data());
+  if (!in) {
+    return kFALSE;
+  }
+  Int_t rank;
+  Long64_t seq;
+  while (in >> rank >> seq) {
+    fNextSeq[rank] = seq;
+  }
+  return kTRUE;
+}
 
-    auto while_end = std::chrono::high_resolution_clock::now();
-    double while_time =
-        std::chrono::duration_cast<std::chrono::duration<double>>(while_end -
-                                                                  while_start)
-            .count();
-    timing_msg << while_time << std::endl;
-    if (timing_msg.str().size() > 40)
-      std::cout << timing_msg.str();
+// Register the streamer infos sent by a worker's schema handshake. Returns
+// true if classes unknown to this collector so far were added.
+Bool_t TMPIFile::RegisterSchema(Int_t source, char *buf, Int_t size) {
+  UInt_t id;
+  memcpy(&id, buf, sizeof(id));
+
+  TBufferFile buffer(TBuffer::kRead, size - sizeof(id), buf + sizeof(id), kFALSE);
+  TList *list = (TList *)buffer.ReadObject(TList::Class());
+  if (!list) {
+    // the buffers relying on it are dropped
+    Error("RegisterSchema", "cannot read the schema sent by worker %d", source);
+    return kFALSE;
+  }
+  fClientSchema[source] = id;
+  // Same order as TSocket::RecvStreamerInfos: regular classes first, then
+  // the STL collections that may refer to them.
+  Bool_t added = kFALSE;
+  for (Int_t pass = 0; pass < 2; ++pass) {
+    TIter next(list);
+    TStreamerInfo *info;
+    while ((info = (TStreamerInfo *)next())) {
+      TObject *element = info->GetElements()->UncheckedAt(0);
+      Bool_t isstl = element && strcmp("This", element->GetName()) == 0;
+      if (isstl != (pass == 1)) {
+        continue;
+      }
+      std::pair<TString, Int_t> cls(info->GetName(), info->GetClassVersion());
+      info->BuildCheck();
+      if (std::find(fSchemaClasses.begin(), fSchemaClasses.end(), cls) == fSchemaClasses.end()) {
+        fSchemaClasses.push_back(cls);
+        added = kTRUE;
+      }
+    }
   }
+  delete list;
+  return added;
+}
 
-  if (fEndProcess == fMPILocalSize - 1) {
-    mergers.Delete();
+// Make sure the merged output describes every class registered by the
+// workers, since their buffers no longer carry the streamer infos.
+void TMPIFile::InjectSchema(TFile *output) {
+  if (!output) {
     return;
   }
+  for (auto &cls : fSchemaClasses) {
+    TClass *cl = TClass::GetClass(cls.first);
+    TVirtualStreamerInfo *info = cl ? cl->GetStreamerInfo(cls.second) : 0;
+    if (info) {
+      info->ForceWriteInfo(output, kTRUE);
+    }
+  }
 }
 
 Bool_t TMPIFile::R__NeedInitialMerge(TDirectory *dir) {
@@ -167,6 +1000,9 @@ Bool_t TMPIFile::R__NeedInitialMerge(TDirectory *dir) {
   TKey *key;
   while ((key = (TKey *)nextkey())) {
     TClass *cl = TClass::GetClass(key->GetClassName());
+    if (!cl) {
+      continue;
+    }
     if (cl->InheritsFrom(TDirectory::Class())) {
       TDirectory *subdir =
           (TDirectory *)dir->GetList()->FindObject(key->GetName());
@@ -187,10 +1023,17 @@ Bool_t TMPIFile::R__NeedInitialMerge(TDirectory *dir) {
 
 TMPIFile::ParallelFileMerger::ParallelFileMerger(const char *filename,
                                                  Int_t compression_settings,
-                                                 Bool_t writeCache)
+                                                 Bool_t writeCache,
+                                                 Long64_t mmapExtent,
+                                                 Bool_t update)
     : fFilename(filename), fClientsContact(0), fMerger(kFALSE, kTRUE) {
   fMerger.SetPrintLevel(0);
-  if (!fMerger.OutputFile(filename, "RECREATE"))
+  const char *mode = update ? "UPDATE" : "RECREATE";
+  if (mmapExtent > 0) {
+    std::unique_ptr<TFile> output(new TMappedFile(filename, mode, "", compression_settings, mmapExtent));
+    if (output->IsZombie() || !fMerger.OutputFile(std::move(output)))
+      exit(1);
+  } else if (!fMerger.OutputFile(filename, mode))
     exit(1);
   fMerger.GetOutputFile()->SetCompressionSettings(compression_settings);
   if (writeCache)
@@ -199,8 +1042,10 @@ TMPIFile::ParallelFileMerger::ParallelFileMerger(const char *filename,
 
 TMPIFile::ParallelFileMerger::~ParallelFileMerger() {
   for (ClientColl_t::iterator iter = fClients.begin(); iter != fClients.end();
-       ++iter)
+       ++iter) {
     delete iter->GetFile();
+    delete iter->GetInputFile();
+  }
 }
 
 ULong_t TMPIFile::ParallelFileMerger::Hash() const { return fFilename.Hash(); }
@@ -217,16 +1062,60 @@ Bool_t TMPIFile::ParallelFileMerger::InitialMerge(TFile *input) {
   return result;
 }
 
+Bool_t TMPIFile::ParallelFileMerger::NTupleMerge(TFile *input) {
+  // Append the RNTuples of the received image to the output ones. Their
+  // pages are copied as they are (kKeepCompression) and the anchors are
+  // removed from the input, which then goes through the regular path.
+  std::vector<TKey *> anchors;
+  TIter nextkey(input->GetListOfKeys());
+  TKey *key;
+  while ((key = (TKey *)nextkey())) {
+    if (TClientInfo::R__IsNTuple(key->GetClassName())) {
+      anchors.push_back(key);
+      fMerger.AddObjectNames(key->GetName());
+    }
+  }
+  if (anchors.empty()) {
+    return kTRUE;
+  }
+  fMerger.AddFile(input);
+  Bool_t result = fMerger.PartialMerge(TFileMerger::kIncremental | TFileMerger::kOnlyListed |
+                                       TFileMerger::kKeepCompression);
+  fMerger.ClearObjectNames();
+  for (auto anchor : anchors) {
+    anchor->Delete();
+    input->GetListOfKeys()->Remove(anchor);
+    delete anchor;
+  }
+  return result;
+}
+
 Bool_t TMPIFile::ParallelFileMerger::Merge() {
   tcl.R__DeleteObject(
       fMerger.GetOutputFile(),
       kFALSE); // removing object that cannot be incrementally merged and will
                // not be reset by the client code..
+  // Histograms binned alike in every client are summed directly, the
+  // merger skips them.
+  std::vector<TDirectory *> inputs;
+  for (UInt_t f = 0; f < fClients.size(); ++f) {
+    inputs.push_back(fClients[f].GetFile());
+  }
+  std::vector<TString> fast;
+  if (fFastHistMerge && std::find(inputs.begin(), inputs.end(), (TDirectory *)0) == inputs.end()) {
+    TMPIHistMerge::MergeDirectory(fMerger.GetOutputFile(), inputs, fast);
+  }
+  fLastFastMerged = fast.size();
+  for (auto &name : fast) {
+    fMerger.AddObjectNames(name);
+  }
   for (UInt_t f = 0; f < fClients.size(); ++f) {
     fMerger.AddFile(fClients[f].GetFile());
   }
   Bool_t result = fMerger.PartialMerge(TFileMerger::kAllIncremental |
-                                       TFileMerger::kKeepCompression);
+                                       TFileMerger::kKeepCompression |
+                                       (fast.empty() ? 0 : TFileMerger::kSkipListed));
+  fMerger.ClearObjectNames();
   // Remove any 'resetable' object (like TTree) from the input file so that they
   // will not be re-merged.  Keep only the object that always need to be
   // re-merged (Histograms).
@@ -252,17 +1141,34 @@ Bool_t TMPIFile::ParallelFileMerger::Merge() {
   return result;
 }
 
+// Clients are kept densely, in the order of their first contact, so that a
+// merge only goes through the files of the clients that exist.
+TClientInfo &TMPIFile::ParallelFileMerger::GetClient(UInt_t clientID) {
+  if (fSlots.size() <= clientID) {
+    fSlots.resize(clientID + 1, -1);
+  }
+  if (fSlots[clientID] < 0) {
+    fSlots[clientID] = fClients.size();
+    fClients.push_back(TClientInfo(std::string(fFilename).c_str(), clientID));
+  }
+  return fClients[fSlots[clientID]];
+}
+
+TFile *TMPIFile::ParallelFileMerger::OpenClientFile(UInt_t clientID,
+                                                    char *buffer,
+                                                    Long64_t size) {
+  // Load a received image through the client's cached input file.
+  return GetClient(clientID).OpenInput(fFilename, buffer, size);
+}
+
 void TMPIFile::ParallelFileMerger::RegisterClient(UInt_t clientID,
                                                   TFile *file) {
   // Register that a client has sent a file.
 
+  TClientInfo &client = GetClient(clientID);
   ++fNClientsContact;
-  fClientsContact.SetBitNumber(clientID);
-  TClientInfo ntcl(std::string(fFilename).c_str(), clientID);
-  if (fClients.size() < clientID + 1) {
-    fClients.push_back(ntcl);
-  }
-  fClients[clientID].SetFile(file);
+  fClientsContact.SetBitNumber(fSlots[clientID]);
+  client.SetFile(file);
 }
 
 Bool_t TMPIFile::ParallelFileMerger::NeedMerge(Float_t clientThreshold) {
@@ -298,77 +1204,48 @@ Bool_t TMPIFile::ParallelFileMerger::NeedFinalMerge() {
 }
 
 void TMPIFile::R__MigrateKey(TDirectory *destination, TDirectory *source) {
-  if (destination == 0 || source == 0)
-    return;
-  TIter nextkey(source->GetListOfKeys());
-  TKey *key;
-  while ((key = (TKey *)nextkey())) {
-    TClass *cl = TClass::GetClass(key->GetClassName());
-    if (cl->InheritsFrom(TDirectory::Class())) {
-      TDirectory *source_subdir =
-          (TDirectory *)source->GetList()->FindObject(key->GetName());
-      if (!source_subdir) {
-        source_subdir = (TDirectory *)key->ReadObj();
-      }
-      TDirectory *destination_subdir =
-          destination->GetDirectory(key->GetName());
-      if (!destination_subdir) {
-        destination_subdir = destination->mkdir(key->GetName());
-      }
-      R__MigrateKey(destination, source);
-    } else {
-      TKey *oldkey = destination->GetKey(key->GetName());
-      if (oldkey) {
-        oldkey->Delete();
-        delete oldkey;
-      }
-      TKey *newkey = new TKey(destination, *key, 0 /* pidoffset */);
-      destination->GetFile()->SumBuffer(newkey->GetObjlen());
-      newkey->WriteFile(0);
-      if (destination->GetFile()->TestBit(TFile::kWriteError)) {
-        return;
-      }
-    }
-  }
-  destination->SaveSelf();
+  TClientInfo::R__MigrateKey(destination, source);
 }
 
 void TMPIFile::R__DeleteObject(TDirectory *dir, Bool_t withReset) {
-  if (dir == 0)
-    return;
+  TClientInfo::R__DeleteObject(dir, withReset);
+}
+
+Bool_t TMPIFile::IsCollector() {
+  if (this->fMPILocalRank) {
+    return kFALSE;
+  }
+  return kTRUE;
+}
 
+// True if the directory holds objects that are not reset after a merge
+// (histograms), to be merged in full from every client.
+Bool_t TMPIFile::R__NeedMerge(TDirectory *dir) {
+  if (dir == 0)
+    return kFALSE;
   TIter nextkey(dir->GetListOfKeys());
   TKey *key;
   while ((key = (TKey *)nextkey())) {
     TClass *cl = TClass::GetClass(key->GetClassName());
+    if (!cl) {
+      continue;
+    }
     if (cl->InheritsFrom(TDirectory::Class())) {
       TDirectory *subdir =
           (TDirectory *)dir->GetList()->FindObject(key->GetName());
       if (!subdir) {
         subdir = (TDirectory *)key->ReadObj();
       }
-      R__DeleteObject(subdir, withReset);
-    } else {
-      Bool_t todelete = kFALSE;
-      if (withReset) {
-        todelete = (0 != cl->GetResetAfterMerge());
-      } else {
-        todelete = (0 == cl->GetResetAfterMerge());
+      if (R__NeedMerge(subdir)) {
+        return kTRUE;
       }
-      if (todelete) {
-        key->Delete();
-        dir->GetListOfKeys()->Remove(key);
-        delete key;
+    } else {
+      if (0 == cl->GetResetAfterMerge()) {
+        return kTRUE;
       }
     }
   }
-}
-
-Bool_t TMPIFile::IsCollector() {
-  if (this->fMPILocalRank) {
-    return kFALSE;
-  }
-  return kTRUE;
+  return kFALSE;
 }
 
 void TMPIFile::CreateBufferAndSend() {
@@ -376,73 +1253,942 @@ void TMPIFile::CreateBufferAndSend() {
     SysError("CreateBufferAndSend"," should not be called by a collector");
     exit(1);
   }
+  auto start = std::chrono::high_resolution_clock::now();
+  std::vector<std::pair<TDirectory *, TObject *>> held;
+  if (fShipEvery != 1 || fForceShip) {
+    Bool_t due = fForceShip || (fShipEvery > 0 && fSyncCount % fShipEvery == 0);
+    HoldBackObjects(this, due, held);
+    for (auto &obj : held) {
+      obj.first->GetList()->Remove(obj.second);
+    }
+    fHeldBack = (fHeldBack && !due) || !held.empty();
+    fMetrics.Add("objects_held_back", held.size());
+  }
+  fSyncCount++;
   this->Write();
-  Int_t count = this->GetEND();
-  fSendBuf = new char[count];
-  this->CopyTo(fSendBuf, count);
-  MPI_Isend(fSendBuf, count, MPI_CHAR, 0, fMPIColor, sub_comm, &fRequest);
+  for (auto &obj : held) {
+    obj.first->GetList()->Add(obj.second);
+  }
+  Long64_t count = this->GetEND();
+  Long64_t chunk = fChunkSize > 0 ? fChunkSize : kMaxChunkSize;
+  std::vector<char> staged;
+  if (fAsync && count > chunk) {
+    // too large for one message of the sender thread, compressed here
+    std::vector<char> image(count);
+    this->CopyTo(image.data(), count);
+    StageImage(image.data(), count, staged, 0);
+    count = staged.size();
+  }
+  Long64_t nchunks = count > chunk ? (count + chunk - 1) / chunk : 1;
+  if (SkipResumed(nchunks)) {
+    return;
+  }
+  if (nchunks > 1) {
+    SendChunks(count, CountEntries(), chunk, staged.empty() ? 0 : staged.data());
+    auto end = std::chrono::high_resolution_clock::now();
+    fMetrics.Fill("sync_time", std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count());
+    fMetrics.Fill("message_size", count);
+    fMetrics.Add("bytes_sent", count);
+    return;
+  }
+  fSendBuf = AcquireMessage(count, CountEntries(), 0);
+  if (staged.empty()) {
+    this->CopyTo(fSendBuf + sizeof(TMPIMessageHeader), count);
+  } else {
+    memcpy(fSendBuf + sizeof(TMPIMessageHeader), staged.data(), count);
+  }
+  // the sender thread compresses the batch, it reports the size it sent
+  Bool_t stage = fAsync && staged.empty();
+  auto end = std::chrono::high_resolution_clock::now();
+  fMetrics.Fill("sync_time", std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count());
+  if (!stage) {
+    fMetrics.Fill("message_size", count);
+    fMetrics.Add("bytes_sent", count);
+  }
+  fMetrics.Add("messages_sent");
+  PostSendBuf(sizeof(TMPIMessageHeader) + count, stage);
+}
+
+// Send the batch, too large for one message, in segments of 'chunk' bytes
+// read straight from this file: it is never copied whole. All but the last
+// segment are sent before returning (or queued to the sender thread).
+// 'image' replaces the file when the batch was staged already or is the
+// one of thread file 'thread'.
+void TMPIFile::SendChunks(Long64_t bytes, Long64_t entries, Long64_t chunk, const char *image, Int_t thread) {
+  for (Long64_t offset = 0; offset < bytes; offset += chunk) {
+    Int_t len = (Int_t)TMath::Min(chunk, bytes - offset);
+    Bool_t last = offset + len == bytes;
+    UInt_t flags = TMPIMessageHeader::kChunk | (last ? TMPIMessageHeader::kLastChunk : 0);
+    char *buf = AcquireMessage(len, last ? entries : 0, flags, thread);
+    if (image) {
+      memcpy(buf + sizeof(TMPIMessageHeader), image + offset, len);
+    } else if (this->ReadBuffer(buf + sizeof(TMPIMessageHeader), offset, len)) {
+      SysError("Sync", "cannot read %d bytes at %lld of the batch", len, offset);
+      exit(1);
+    }
+    fMetrics.Add("chunks_sent");
+    if (last) {
+      fSendBuf = buf;
+      fMetrics.Add("messages_sent");
+      PostSendBuf(sizeof(TMPIMessageHeader) + len);
+    } else if (fAsync) {
+      QueueSend(buf, sizeof(TMPIMessageHeader) + len);
+    } else {
+      Transmit(buf, sizeof(TMPIMessageHeader) + len, fMessageTag);
+      fBufferPool.Release(buf);
+    }
+  }
+}
+
+// With the schema handshake on, the worker's buffers carry no streamer
+// info record: classes not yet registered with the collector are sent once
+// in a separate message and the record is left out of the image.
+void TMPIFile::WriteStreamerInfo() {
+  if (!fSchemaHandshake || this->IsCollector()) {
+    TMemFile::WriteStreamerInfo();
+    return;
+  }
+  if (!fClassIndex || fClassIndex->fArray[0] == 0) {
+    return;
+  }
+  TList list;
+  TIter next(gROOT->GetListOfStreamerInfo());
+  TStreamerInfo *info;
+  while ((info = (TStreamerInfo *)next())) {
+    Int_t uid = info->GetNumber();
+    if (uid >= fClassIndex->fN || !fClassIndex->fArray[uid]) {
+      continue;
+    }
+    if ((Int_t)fSchemaSent.size() <= uid) {
+      fSchemaSent.resize(uid + 1, 0);
+    }
+    if (!fSchemaSent[uid]) {
+      list.Add(info);
+      fSchemaSent[uid] = 1;
+      TString sig;
+      sig.Form("%s;%d;%u", info->GetName(), info->GetClassVersion(), info->GetCheckSum());
+      fSchemaId = fSchemaId * 31 + sig.Hash();
+    }
+  }
+  fClassIndex->fArray[0] = 0;
+  if (list.GetSize() == 0) {
+    return;
+  }
+
+  TBufferFile buffer(TBuffer::kWrite);
+  buffer.WriteObject(&list);
+  Int_t count = sizeof(fSchemaId) + buffer.Length();
+  char *msg = AcquireMessage(count, 0, TMPIMessageHeader::kSchema);
+  char *payload = msg + sizeof(TMPIMessageHeader);
+  memcpy(payload, &fSchemaId, sizeof(fSchemaId));
+  memcpy(payload + sizeof(fSchemaId), buffer.Buffer(), buffer.Length());
+  // Blocking: the schema has to reach the collector before the buffers
+  // relying on it, which MPI's non-overtaking order then guarantees.
+  SendBlocking(msg, sizeof(TMPIMessageHeader) + count, fMessageTag);
+  fBufferPool.Release(msg);
+}
+
+void TMPIFile::SetSchemaHandshake(Bool_t enable)
+{
+  fSchemaHandshake = enable;
+}
+
+// Ship the objects that are not reset after a merge (histograms) only every
+// 'every' syncs (never in between for 0), and in between those whose
+// entries changed by more than 'threshold' (relative, < 0 to ignore
+// changes). Trees go with every sync; MPIClose() ships the final state.
+void TMPIFile::SetHistogramShipping(Int_t every, Double_t threshold)
+{
+  fShipEvery = every < 0 ? 0 : every;
+  fShipThreshold = threshold;
+}
+
+void TMPIFile::SetChunkSize(Long64_t chunkSize)
+{
+  fChunkSize = chunkSize > kMaxChunkSize ? kMaxChunkSize : chunkSize;
+}
+
+UInt_t TMPIFile::GetSchemaId() const
+{
+  return fSchemaId;
 }
 
 void TMPIFile::CreateEmptyBufferAndSend() {
   if (this->IsCollector()) {
     return;
   }
+  // The collector stops listening after the empty buffer, the final Close()
+  // writes its streamer infos locally.
+  fSchemaHandshake = kFALSE;
 
-  if (fRequest) {
-    auto start = std::chrono::high_resolution_clock::now();
-    MPI_Wait(&fRequest, MPI_STATUS_IGNORE);
-    auto end = std::chrono::high_resolution_clock::now();
-    double time = std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count();
-    std::cout << "[" << fMPIColor << "]"
-              << "[" << fMPILocalRank << "] wait time: "
-              << time << std::endl;
-    fRequest = 0;
-    delete [] fSendBuf;
-  }
-  Int_t sent = MPI_Send(fSendBuf, 0, MPI_CHAR, 0, fMPIColor, sub_comm);
-  if (sent) {
-    delete [] fSendBuf;
-  }
+  WaitForRequest();
+  char *msg = AcquireMessage(0, 0, TMPIMessageHeader::kEndOfJob);
+  SendBlocking(msg, sizeof(TMPIMessageHeader), fMessageTag);
+  fBufferPool.Release(msg);
 }
 
 // Synching defines the communication method between worker/collector
 void TMPIFile::Sync() {
-  // check if the previous send request is accepted by master.
-  if (!fRequest) { // if accpeted create and send current batch
-    CreateBufferAndSend();
-  } else {
-    // if not accepted wait until received by master
-    auto start = std::chrono::high_resolution_clock::now();
-    MPI_Wait(&fRequest, MPI_STATUS_IGNORE);
-    auto end = std::chrono::high_resolution_clock::now();
-    double time = std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count();
-    std::cout << "[" << fMPIColor << "]"
-              << "[" << fMPILocalRank << "] wait time: "
-              << time << std::endl;
-    delete[] fSendBuf; // empty the buffer once received by master
-    // Reset the frequest once accepted by master and send new buffer
-    fRequest = 0;
-    CreateBufferAndSend();
+  if (this->IsCollector()) {
+    MergeLocal();
+    return;
+  }
+  // wait until the previous batch is received by master, then send the
+  // current one
+  WaitForRequest();
+  if (fThreadFiles) {
+    SendThreadBuffers();
+    return;
+  }
+#ifdef TMPI_RNTUPLE
+  // Destroying the writer commits the batch and writes its anchor.
+  if (fNTupleWriter) {
+    fNTupleEntries = fNTupleWriter->GetNEntries();
+  }
+  fNTupleWriter.reset();
+#endif
+  CreateBufferAndSend();
+  this->ResetAfterMerge((TFileMergeInfo *)0);
+#ifdef TMPI_RNTUPLE
+  if (fNTupleModel) {
+    OpenNTupleWriter();
+  }
+#endif
+}
+
+TMPIThreadFile::TMPIThreadFile(TMPIFile *owner, Int_t index, Int_t compress)
+    : TMemFile(owner->GetName(), "RECREATE", "", compress), fOwner(owner), fIndex(index) {}
+
+// Called by the filling thread, no MPI involved.
+void TMPIThreadFile::Sync() {
+  this->Write();
+  std::vector<char> image(this->GetEND());
+  this->CopyTo(image.data(), image.size());
+  Long64_t entries = R__CountTreeEntries(this);
+  this->ResetAfterMerge((TFileMergeInfo *)0);
+  fOwner->QueueThreadBuffer(std::move(image), entries, fIndex);
+}
+
+// The file becomes the calling thread's current directory, its trees have
+// to be created afterwards (or moved to it with SetDirectory).
+TMPIThreadFile *TMPIFile::CreateThreadFile() {
+  if (this->IsCollector()) {
+    SysError("CreateThreadFile", " should not be called by a collector");
+    exit(1);
+  }
+  ROOT::EnableThreadSafety();
+  std::lock_guard<std::mutex> lock(fThreadMutex);
+  // their batches are sent as they are, also by an asynchronous Sync()
+  return new TMPIThreadFile(this, fThreadFiles++, fAsync ? fAsyncCodec : this->GetCompressionSettings());
+}
+
+void TMPIFile::QueueThreadBuffer(std::vector<char> &&image, Long64_t entries, Int_t thread) {
+  std::lock_guard<std::mutex> lock(fThreadMutex);
+  fThreadBuffers.push_back({std::move(image), entries, thread});
+}
+
+// Send the batches queued by the thread files as multipart messages: a part
+// table (number of parts, then size, entries and thread file of each)
+// followed by the images. The collector merges every part as it would a
+// buffer of its own, each thread file being a client of its own. Parts go
+// in as few messages of at most a chunk as possible, a part larger than
+// that is streamed alone.
+void TMPIFile::SendThreadBuffers() {
+  auto start = std::chrono::high_resolution_clock::now();
+  std::vector<ThreadBuffer_t> parts;
+  {
+    std::lock_guard<std::mutex> lock(fThreadMutex);
+    parts.swap(fThreadBuffers);
+  }
+  if (parts.empty()) {
+    return;
+  }
+  Long64_t chunk = fChunkSize > 0 ? fChunkSize : kMaxChunkSize;
+  std::vector<size_t> groups; // first part of each message
+  Long64_t bytes = 0;
+  for (size_t i = 0; i < parts.size(); i++) {
+    Long64_t size = sizeof(Long64_t) * 3 + parts[i].fImage.size();
+    if (groups.empty() || bytes + size > chunk) {
+      groups.push_back(i);
+      bytes = sizeof(Long64_t);
+    }
+    bytes += size;
+  }
+  groups.push_back(parts.size());
+  Long64_t messages = 0;
+  for (size_t g = 0; g + 1 < groups.size(); g++) {
+    Long64_t size = parts[groups[g]].fImage.size();
+    messages += groups[g + 1] - groups[g] == 1 && size > chunk ? (size + chunk - 1) / chunk : 1;
   }
+  if (SkipResumed(messages)) {
+    return;
+  }
+  for (size_t g = 0; g + 1 < groups.size(); g++) {
+    // the previous message's buffer is reused
+    WaitForRequest();
+    ThreadBuffer_t &part = parts[groups[g]];
+    if (groups[g + 1] - groups[g] == 1 && (Long64_t)part.fImage.size() > chunk) {
+      SendChunks(part.fImage.size(), part.fEntries, chunk, part.fImage.data(), part.fThread);
+      fMetrics.Add("parts_sent");
+      fMetrics.Fill("message_size", part.fImage.size());
+      fMetrics.Add("bytes_sent", part.fImage.size());
+    } else {
+      SendMultipart(parts, groups[g], groups[g + 1]);
+    }
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  fMetrics.Fill("sync_time", std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count());
+}
+
+// One multipart message of the parts [first, last).
+void TMPIFile::SendMultipart(std::vector<ThreadBuffer_t> &parts, size_t first, size_t last) {
+  Long64_t nparts = last - first;
+  Long64_t bytes = sizeof(Long64_t) * (1 + 3 * nparts);
+  Long64_t entries = 0;
+  for (size_t i = first; i < last; i++) {
+    bytes += parts[i].fImage.size();
+    entries += parts[i].fEntries;
+  }
+  fSendBuf = AcquireMessage(bytes, entries, TMPIMessageHeader::kMultipart);
+  char *table = fSendBuf + sizeof(TMPIMessageHeader);
+  char *image = table + sizeof(Long64_t) * (1 + 3 * nparts);
+  memcpy(table, &nparts, sizeof(nparts));
+  for (Long64_t i = 0; i < nparts; i++) {
+    ThreadBuffer_t &part = parts[first + i];
+    Long64_t entry[3] = {(Long64_t)part.fImage.size(), part.fEntries, part.fThread};
+    memcpy(table + sizeof(Long64_t) * (1 + 3 * i), entry, sizeof(entry));
+    memcpy(image, part.fImage.data(), entry[0]);
+    image += entry[0];
+  }
+  fMetrics.Fill("message_size", bytes);
+  fMetrics.Add("messages_sent");
+  fMetrics.Add("parts_sent", nparts);
+  fMetrics.Add("bytes_sent", bytes);
+  PostSendBuf(sizeof(TMPIMessageHeader) + bytes);
+}
+
+// Merge the images of a multipart message one after the other; the CCT line
+// of the message shows the last one.
+void TMPIFile::MergeParts(Int_t source, char *buf, Long64_t bytes, std::stringstream &timing_msg) {
+  Long64_t nparts;
+  memcpy(&nparts, buf, sizeof(nparts));
+  char *image = buf + sizeof(Long64_t) * (1 + 3 * nparts);
+  if (nparts < 0 || image > buf + bytes) {
+    Error("MergeParts", "malformed part table of %lld parts dropped", nparts);
+    fMetrics.Add("messages_malformed");
+    return;
+  }
+  for (Long64_t i = 0; i < nparts; i++) {
+    Long64_t entry[3];
+    memcpy(entry, buf + sizeof(Long64_t) * (1 + 3 * i), sizeof(entry));
+    Long64_t size = entry[0];
+    if (size < 0 || image + size > buf + bytes || entry[2] < 0 || entry[2] >= kMaxInt / fMPILocalSize) {
+      Error("MergeParts", "part %lld of %lld is truncated, dropped with the following ones", i, nparts);
+      fMetrics.Add("messages_malformed");
+      return;
+    }
+    std::stringstream part_msg;
+    MergeBuffer(ClientId(source, entry[2]), image, size, i == nparts - 1 ? timing_msg : part_msg);
+    fMetrics.Add("parts_received");
+    image += size;
+  }
+}
+
+// A collector producing events itself merges its batch directly.
+void TMPIFile::MergeLocal() {
+  if (!fCollecting) {
+    SysError("Sync", " a collector has to call StartCollector() before Sync()");
+    exit(1);
+  }
+  this->Write();
+  // the collector's own batches are checkpointed as those of rank 0
+  Long64_t &next = fNextSeq[fMPILocalRank];
+  if (fSeq++ < next) {
+    fMetrics.Add("messages_skipped");
+    this->ResetAfterMerge((TFileMergeInfo *)0);
+    return;
+  }
+  next = fSeq;
+  Int_t count = this->GetEND();
+  char *buf = fBufferPool.Acquire(count);
+  this->CopyTo(buf, count);
+  std::stringstream timing_msg; // kept out of the CCT lines of the workers' messages
+  MergeBuffer(ClientId(fMPILocalRank), buf, count, timing_msg);
+  fBufferPool.Release(buf);
   this->ResetAfterMerge((TFileMergeInfo *)0);
 }
 
+// Complete the pending send, if any, and recycle its buffer.
+void TMPIFile::WaitForRequest() {
+  if (!fRequest) {
+    return;
+  }
+  auto start = std::chrono::high_resolution_clock::now();
+  MPI_Wait(&fRequest, MPI_STATUS_IGNORE);
+  auto end = std::chrono::high_resolution_clock::now();
+  double time = std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count();
+  std::cout << "[" << fMPIColor << "]"
+            << "[" << fMPILocalRank << "] wait time: "
+            << time << std::endl;
+  fMetrics.Fill("wait_time", time);
+  fRequest = 0;
+  fBufferPool.Release(fSendBuf);
+  fSendBuf = 0;
+}
+
+// Send an already serialized file image to the collector as if it had been
+// produced by Sync(); used to replay pre-generated buffers.
+void TMPIFile::SendBuffer(const char *buffer, Int_t count, Long64_t entries) {
+  if (this->IsCollector()) {
+    SysError("SendBuffer", " should not be called by a collector");
+    exit(1);
+  }
+  WaitForRequest();
+  if (SkipResumed()) {
+    return;
+  }
+  fMetrics.Fill("message_size", count);
+  fMetrics.Add("messages_sent");
+  fMetrics.Add("bytes_sent", count);
+  fSendBuf = AcquireMessage(count, entries, 0);
+  memcpy(fSendBuf + sizeof(TMPIMessageHeader), buffer, count);
+  PostSendBuf(sizeof(TMPIMessageHeader) + count);
+}
+
+// Collect the non-resettable objects of 'dir' and its subdirectories to
+// leave out of this buffer: all of them unless the sync is 'due', except
+// those never shipped or whose entries changed beyond the threshold. The
+// collector keeps merging the last ones it received.
+void TMPIFile::HoldBackObjects(TDirectory *dir, Bool_t due, std::vector<std::pair<TDirectory *, TObject *>> &held) {
+  TIter next(dir->GetList());
+  TObject *obj;
+  while ((obj = next())) {
+    if (obj->InheritsFrom(TDirectory::Class())) {
+      HoldBackObjects((TDirectory *)obj, due, held);
+      continue;
+    }
+    if (obj->IsA()->GetResetAfterMerge()) {
+      continue;
+    }
+    TString path = dir->GetPath();
+    path += "/";
+    path += obj->GetName();
+    Double_t entries = obj->InheritsFrom(TH1::Class()) ? ((TH1 *)obj)->GetEntries() : 0;
+    auto shipped = fShippedEntries.find(path);
+    Bool_t changed = shipped == fShippedEntries.end() ||
+                     (fShipThreshold >= 0 && TMath::Abs(entries - shipped->second) >
+                                                 fShipThreshold * TMath::Max(TMath::Abs(shipped->second), 1.));
+    if (due || changed) {
+      fShippedEntries[path] = entries;
+    } else {
+      held.emplace_back(dir, obj);
+    }
+  }
+}
+
+// After a restart, the batches the checkpointed output already contains are
+// not sent again; the job has to reproduce them in the same order. A
+// streamed batch takes one message per segment.
+Bool_t TMPIFile::SkipResumed(Long64_t messages) {
+  if (fSeq >= fResumeSeq) {
+    return kFALSE;
+  }
+  fSeq += messages;
+  fMetrics.Add("messages_skipped");
+  return kTRUE;
+}
+
+// Take a buffer from the pool for a message of 'bytes' payload bytes, with
+// its header filled; the payload goes after the header.
+char *TMPIFile::AcquireMessage(Long64_t bytes, Long64_t entries, UInt_t flags, Int_t thread) {
+  TMPIMessageHeader header;
+  header.fWorker = fMPILocalRank;
+  header.fSeq = fSeq++;
+  header.fBytes = bytes;
+  header.fEntries = entries;
+  header.fCodec = fAsync ? fAsyncCodec : this->GetCompressionSettings();
+  header.fFlags = flags;
+  // Write() has registered the classes of the image by now
+  header.fSchemaId = fSchemaHandshake ? fSchemaId : 0;
+  header.fThread = thread;
+  char *buf = fBufferPool.Acquire(sizeof(header) + bytes);
+  memcpy(buf, &header, sizeof(header));
+  return buf;
+}
+
+// Entries of the batch about to be sent: those of the largest tree, or of
+// the RNTuple committed by Sync().
+Long64_t TMPIFile::CountEntries() {
+  Long64_t entries = R__CountTreeEntries(this);
+#ifdef TMPI_RNTUPLE
+  entries = TMath::Max(entries, fNTupleEntries);
+  fNTupleEntries = 0;
+#endif
+  return entries;
+}
+
+// Drop a message already received and report the ones missing before it.
+Bool_t TMPIFile::CheckSequence(Int_t source, const TMPIMessageHeader &header) {
+  Long64_t &next = fNextSeq[source];
+  if (header.fSeq < next) {
+    if (header.fFlags & (TMPIMessageHeader::kSchema | TMPIMessageHeader::kEndOfJob)) {
+      // replayed by a worker resuming after a restart, never dropped
+      return kTRUE;
+    }
+    Warning("HandleMessage", "duplicate message %lld from worker %d dropped", header.fSeq, source);
+    fMetrics.Add("messages_duplicated");
+    return kFALSE;
+  }
+  if (header.fSeq > next) {
+    Error("HandleMessage", "%lld messages from worker %d lost before message %lld",
+          header.fSeq - next, source, header.fSeq);
+    fMetrics.Add("messages_lost", header.fSeq - next);
+  }
+  next = header.fSeq + 1;
+  return kTRUE;
+}
+
+// Tag of the messages to the collector, which only listens to that tag:
+// with a single output the workers share MPI_COMM_WORLD with the
+// application.
+void TMPIFile::SetMessageTag(Int_t tag)
+{
+  if (tag < 0 || tag > 32767) { // MPI guarantees tags up to at least 32767
+    SysError("SetMessageTag", "tag %d out of the range [0, 32767]", tag);
+    exit(1);
+  }
+  if (fCollecting || fSeq) {
+    SysError("SetMessageTag", " has to be called before any message is sent");
+    exit(1);
+  }
+  fMessageTag = tag;
+}
+
+Int_t TMPIFile::GetMessageTag() const
+{
+  return fMessageTag;
+}
+
+// Every rank of the sub-communicator has to call it before the first
+// Sync(). On a restart the collector reopens its output and tells each
+// worker how many of its messages the last checkpoint holds.
+void TMPIFile::SetCheckpoint(Double_t interval, Bool_t restart, Bool_t deterministic)
+{
+  if (fCollecting || fSeq) {
+    SysError("SetCheckpoint", " has to be called before any message is sent");
+    exit(1);
+  }
+  std::vector<Long64_t> resume;
+  if (this->IsCollector()) {
+    this->SetOutputName();
+    fCheckpointInterval = interval;
+    fLastCheckpoint = std::chrono::high_resolution_clock::now();
+    if (restart && !deterministic) {
+      // the regenerated batches would not match the ones in the output
+      Warning("SetCheckpoint", "resuming from %s needs a job that reproduces its batches exactly, "
+                               "not stated with 'deterministic': starting from scratch", GetCheckpointName().Data());
+      restart = kFALSE;
+    }
+    fRestart = restart && ReadCheckpointState();
+    if (restart && !fRestart) {
+      Warning("SetCheckpoint", "no checkpoint %s, starting from scratch", GetCheckpointName().Data());
+    }
+    resume.resize(fMPILocalSize, 0);
+    for (auto &seq : fNextSeq) {
+      if (seq.first > 0 && seq.first < fMPILocalSize) {
+        resume[seq.first] = seq.second;
+      }
+    }
+  }
+  if (fLocal) {
+    if (this->IsCollector()) {
+      fLocal->PublishResume(resume);
+    } else {
+      fResumeSeq = fLocal->WaitResume(fMPILocalRank);
+    }
+    return;
+  }
+  MPI_Scatter(resume.data(), 1, MPI_LONG_LONG, &fResumeSeq, 1, MPI_LONG_LONG, 0, sub_comm);
+}
+
+// Send the message in fSendBuf: asynchronously, completed by the next
+// WaitForRequest(), or through the RMA window where it completes at once.
+void TMPIFile::PostSendBuf(Int_t count, Bool_t stage) {
+  if (fLocal) {
+    PushLocal(fSendBuf, count);
+    fSendBuf = 0;
+    return;
+  }
+  if (fAsync) {
+    QueueSend(fSendBuf, count, stage);
+    fSendBuf = 0;
+    return;
+  }
+  if (fWindow) {
+    PutBuffer(fSendBuf, count);
+    fBufferPool.Release(fSendBuf);
+    fSendBuf = 0;
+    return;
+  }
+  MPI_Isend(fSendBuf, count, MPI_CHAR, 0, fMessageTag, sub_comm, &fRequest);
+}
+
+// Hand a message to the sender thread. Sync() only blocks when 'depth'
+// batches are still waiting, the time it does is the async_block_time. It
+// is also the wait_time, the synchronous mode's MPI_Wait() it replaces.
+void TMPIFile::QueueSend(char *buf, Int_t count, Bool_t stage) {
+  auto start = std::chrono::high_resolution_clock::now();
+  {
+    std::unique_lock<std::mutex> lock(fSendMutex);
+    fSendCond.wait(lock, [this] { return (Int_t)fSendQueue.size() < fAsyncDepth; });
+    fSendQueue.push_back({buf, count, stage});
+  }
+  fSendCond.notify_all();
+  auto end = std::chrono::high_resolution_clock::now();
+  double time = std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count();
+  fMetrics.Fill("async_block_time", time);
+  fMetrics.Fill("wait_time", time);
+  CollectSent();
+}
+
+// Compress a batch written without compression into 'staged', after
+// 'reserve' bytes left for the header: the baskets are merged into a
+// staging file with the settings of the run, which the collector keeps
+// (kKeepCompression).
+void TMPIFile::StageImage(char *image, Long64_t bytes, std::vector<char> &staged, Long64_t reserve) {
+  TMemFile *input = new TMemFile(this->GetName(), image, bytes);
+  TFileMerger merger(kFALSE, kFALSE);
+  merger.SetPrintLevel(0);
+  merger.OutputFile(std::unique_ptr<TFile>(new TMemFile(this->GetName(), "RECREATE", "", fAsyncCodec)));
+  merger.AddFile(input);
+  if (!merger.PartialMerge(TFileMerger::kAllIncremental)) {
+    SysError("Sync", "cannot compress the batch");
+    exit(1);
+  }
+  delete input;
+  TMemFile *output = (TMemFile *)merger.GetOutputFile();
+  output->Write();
+  staged.resize(reserve + output->GetEND());
+  output->CopyTo(staged.data() + reserve, output->GetEND());
+}
+
+// Recycle the buffers the sender is done with and record its timings; the
+// pool and the metrics are only touched by the caller's thread.
+void TMPIFile::CollectSent() {
+  std::vector<char *> sent;
+  std::vector<std::pair<double, Long64_t>> staged;
+  {
+    std::lock_guard<std::mutex> lock(fSendMutex);
+    sent.swap(fSent);
+    staged.swap(fStaged);
+  }
+  for (char *buf : sent) {
+    fBufferPool.Release(buf);
+  }
+  for (auto &batch : staged) {
+    fMetrics.Fill("hidden_time", batch.first);
+    fMetrics.Fill("message_size", batch.second);
+    fMetrics.Add("bytes_sent", batch.second);
+  }
+}
+
+// Wait for the sender to send everything queued.
+void TMPIFile::FlushAsync() {
+  if (!fAsync) {
+    return;
+  }
+  auto start = std::chrono::high_resolution_clock::now();
+  {
+    std::unique_lock<std::mutex> lock(fSendMutex);
+    fSendCond.wait(lock, [this] { return fSendQueue.empty() && !fSending; });
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  fMetrics.Fill("async_block_time", std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count());
+  CollectSent();
+}
+
+void TMPIFile::StopSender() {
+  if (!fSender.joinable()) {
+    return;
+  }
+  FlushAsync();
+  {
+    std::lock_guard<std::mutex> lock(fSendMutex);
+    fSenderStop = kTRUE;
+  }
+  fSendCond.notify_all();
+  fSender.join();
+  fAsync = kFALSE;
+  // trees created meanwhile keep writing uncompressed baskets
+  this->SetCompressionSettings(fAsyncCodec);
+}
+
+// The sender compresses the batches, the work taken off the filling thread
+// (hidden_time), and sends them with blocking calls.
+void TMPIFile::RunSender() {
+  while (true) {
+    AsyncMessage_t msg;
+    {
+      std::unique_lock<std::mutex> lock(fSendMutex);
+      fSendCond.wait(lock, [this] { return fSenderStop || !fSendQueue.empty(); });
+      if (fSendQueue.empty()) {
+        return;
+      }
+      msg = fSendQueue.front();
+      fSendQueue.pop_front();
+      fSending = kTRUE;
+    }
+    fSendCond.notify_all();
+    if (!msg.fStage) {
+      Transmit(msg.fBuf, msg.fCount, fMessageTag);
+      std::lock_guard<std::mutex> lock(fSendMutex);
+      fSent.push_back(msg.fBuf);
+      fSending = kFALSE;
+    } else {
+      auto start = std::chrono::high_resolution_clock::now();
+      TMPIMessageHeader header;
+      memcpy(&header, msg.fBuf, sizeof(header));
+      std::vector<char> staged;
+      StageImage(msg.fBuf + sizeof(header), header.fBytes, staged, sizeof(header));
+      header.fBytes = staged.size() - sizeof(header);
+      memcpy(staged.data(), &header, sizeof(header));
+      auto end = std::chrono::high_resolution_clock::now();
+      Transmit(staged.data(), staged.size(), fMessageTag);
+      std::lock_guard<std::mutex> lock(fSendMutex);
+      fSent.push_back(msg.fBuf);
+      fStaged.emplace_back(std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count(),
+                           header.fBytes);
+      fSending = kFALSE;
+    }
+    fSendCond.notify_all();
+  }
+}
+
+// Start or stop the sender thread; workers only, before or between syncs.
+void TMPIFile::SetAsyncSync(Bool_t enable, Int_t depth)
+{
+  if (this->IsCollector()) {
+    return;
+  }
+  StopSender();
+  if (!enable) {
+    return;
+  }
+  if (fLocal) {
+    // a Sync() only queues the buffer in this mode already
+    Warning("SetAsyncSync", "not needed in the in-process mode, ignored");
+    return;
+  }
+  Int_t provided;
+  MPI_Query_thread(&provided);
+  if (provided < MPI_THREAD_MULTIPLE) {
+    Warning("SetAsyncSync", "MPI was not initialized with MPI_THREAD_MULTIPLE, Sync() stays synchronous");
+    return;
+  }
+  WaitForRequest();
+  // the staging files are opened on the sender thread
+  ROOT::EnableThreadSafety();
+  fAsyncDepth = depth > 0 ? depth : 1;
+  fAsyncCodec = this->GetCompressionSettings();
+  // trees created from now on write uncompressed baskets, the sender
+  // compresses them
+  this->SetCompressionSettings(0);
+  fSenderStop = kFALSE;
+  fAsync = kTRUE;
+  fSender = std::thread(&TMPIFile::RunSender, this);
+}
+
+// Deliver a message to the collector before returning, through the RMA
+// window if there is one and the message fits in a slot.
+void TMPIFile::SendBlocking(const char *buf, Int_t count, Int_t tag) {
+  // after the batches the sender still holds, to keep the message order
+  FlushAsync();
+  Transmit(buf, count, tag);
+}
+
+void TMPIFile::Transmit(const char *buf, Int_t count, Int_t tag) {
+  if (fLocal) {
+    // the caller keeps its buffer: pass a copy and wait for it to be consumed
+    char *copy = fBufferPool.Acquire(count);
+    memcpy(copy, buf, count);
+    PushLocal(copy, count);
+    while (fLocalInFlight) {
+      std::this_thread::yield();
+      ReclaimLocal();
+    }
+    return;
+  }
+  if (fWindow && fWindow->Put(buf, count, tag)) {
+    return;
+  }
+  MPI_Send(const_cast<char *>(buf), count, MPI_CHAR, 0, tag, sub_comm);
+}
+
+// In-process mode: queue a message to the collector, which owns the buffer
+// until it hands it back. Only waits with 'depth' messages in flight.
+void TMPIFile::PushLocal(char *buf, Int_t count) {
+  auto start = std::chrono::high_resolution_clock::now();
+  ReclaimLocal();
+  while (fLocalInFlight >= fLocal->GetDepth() || !fLocal->ToCollector(fMPILocalRank).Push(buf, count)) {
+    std::this_thread::yield();
+    ReclaimLocal();
+  }
+  fLocalInFlight++;
+  auto end = std::chrono::high_resolution_clock::now();
+  fMetrics.Fill("wait_time", std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count());
+}
+
+void TMPIFile::ReclaimLocal() {
+  char *buf;
+  Int_t count;
+  while (fLocal->ToWorker(fMPILocalRank).Pop(buf, count)) {
+    fBufferPool.Release(buf);
+    fLocalInFlight--;
+  }
+}
+
+// A put completes once the image is in the collector's window, there is no
+// request left to wait for: the time it takes is the worker's wait time.
+void TMPIFile::PutBuffer(const char *buf, Int_t count) {
+  auto start = std::chrono::high_resolution_clock::now();
+  SendBlocking(buf, count, fMessageTag);
+  auto end = std::chrono::high_resolution_clock::now();
+  fMetrics.Fill("wait_time", std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count());
+}
+
+// Replace the two-sided messages to the collector by puts into a window of
+// 'nslots' slots of 'slotSize' bytes it exposes (TMPIWindow). Every rank
+// of the sub-communicator has to call it, and MPIClose() as well.
+void TMPIFile::SetRMATransport(Bool_t enable, Int_t nslots, Long64_t slotSize)
+{
+  if (fCollecting || fSeq) {
+    SysError("SetRMATransport", " has to be called before any message is sent");
+    exit(1);
+  }
+  if (fLocal) {
+    Warning("SetRMATransport", "not available in the in-process mode, ignored");
+    return;
+  }
+  delete fWindow;
+  fWindow = enable ? new TMPIWindow(sub_comm, nslots, slotSize) : 0;
+}
+
 void TMPIFile::MPIClose() {
+  FinishCollector();
+#ifdef TMPI_RNTUPLE
+  // Whatever was filled since the last Sync() is not sent, as for trees.
+  fNTupleWriter.reset();
+  fNTupleModel.reset();
+#endif
+  if (fThreadFiles) {
+    // batches the threads queued after the last Sync()
+    WaitForRequest();
+    SendThreadBuffers();
+  }
+  if (fHeldBack && !this->IsCollector()) {
+    // the collector has to end up with the final state of every object,
+    // this buffer also carries what was filled since the last Sync()
+    WaitForRequest();
+    fForceShip = kTRUE;
+    CreateBufferAndSend();
+    fForceShip = kFALSE;
+  }
   CreateEmptyBufferAndSend();
+  StopSender();
+  // freeing the window is collective, every message has been consumed now
+  delete fWindow;
+  fWindow = 0;
   this->Close();
+
+  if (fMetricsOutput.Length()) {
+    fMetrics.SetInfo("global_rank", fMPIGlobalRank);
+    fMetrics.SetInfo("global_size", fMPIGlobalSize);
+    fMetrics.SetInfo("local_rank", fMPILocalRank);
+    fMetrics.SetInfo("local_size", fMPILocalSize);
+    fMetrics.SetInfo("color", fMPIColor);
+    fMetrics.SetInfo("split_level", fSplitLevel);
+    fMetrics.SetInfo("collector", this->IsCollector());
+    TString filename;
+    filename.Form("%s_%d.json", fMetricsOutput.Data(), fMPIGlobalRank);
+    fMetrics.WriteJSON(filename);
+  }
+}
+
+#ifdef TMPI_RNTUPLE
+TMPINTuple::RNTupleWriter *TMPIFile::CreateNTuple(std::unique_ptr<TMPINTuple::RNTupleModel> model, const char *name)
+{
+  if (this->IsCollector()) {
+    SysError("CreateNTuple", " should not be called by a collector");
+    exit(1);
+  }
+  fNTupleName = name;
+  fNTupleModel = std::move(model);
+  OpenNTupleWriter();
+  return fNTupleWriter.get();
+}
+
+TMPINTuple::RNTupleWriter *TMPIFile::GetNTupleWriter() const
+{
+  return fNTupleWriter.get();
+}
+
+// Every batch is a complete RNTuple of its own; the pages are compressed
+// with the file's settings so that the collector can copy them as they are.
+void TMPIFile::OpenNTupleWriter()
+{
+  TMPINTuple::RNTupleWriteOptions options;
+  options.SetCompression(this->GetCompressionSettings());
+  fNTupleWriter = TMPINTuple::RNTupleWriter::Append(fNTupleModel->Clone(), fNTupleName.Data(), *this, options);
+}
+#endif
+
+// Write this rank's metrics to <prefix>_<global rank>.json in MPIClose().
+void TMPIFile::SetMetricsOutput(const char *prefix)
+{
+  fMetricsOutput = prefix ? prefix : "";
+}
+
+const TMPIMetrics &TMPIFile::GetMetrics() const
+{
+  return fMetrics;
+}
+
+// Block size and high-water retention of the pool holding the send
+// (worker) and receive (collector) buffers.
+void TMPIFile::SetBufferPool(Long64_t blockSize, Long64_t highWater)
+{
+  fBufferPool.SetBlockSize(blockSize);
+  fBufferPool.SetHighWater(highWater);
+}
+
+const TBufferPool::Stats &TMPIFile::GetBufferPoolStats() const
+{
+  return fBufferPool.GetStats();
 }
 
 void TMPIFile::SetOutputName() {
+  fMPIFilename = GetOutputName();
+  for (auto &stream : fStreams) {
+    stream.fOutput = GetOutputName(stream.fName);
+  }
+}
+
+TString TMPIFile::GetOutputName(const char *stream) const {
   std::string _filename = this->GetName();
 
   ULong_t found = _filename.rfind(".root");
   if (found != std::string::npos) {
     _filename.resize(found);
   }
-  fMPIFilename = _filename;
-  fMPIFilename += "_";
-  fMPIFilename += fMPIColor;
-  fMPIFilename += ".root";
+  TString output = _filename;
+  if (stream) {
+    output += "_";
+    output += stream;
+  }
+  output += "_";
+  output += fMPIColor;
+  output += ".root";
+  return output;
 }
 
 void TMPIFile::CheckSplitLevel() {
@@ -480,6 +2226,7 @@ void TMPIFile::SplitMPIComm() {
   }
   MPI_Comm_size(sub_comm, &fMPILocalSize);
   MPI_Comm_rank(sub_comm, &fMPILocalRank);
+  fMessageTag = fMPIColor;
 }
 
 Int_t TMPIFile::GetMPIGlobalSize() const
@@ -13,14 +13,55 @@
 #define ROOT_TMPIFile
 
 #include "TClientInfo.h"
+#include "TBufferPool.h"
+#include "TMPILocal.h"
+#include "TMPIMessage.h"
+#include "TMPIMetrics.h"
+#include "TMPIWindow.h"
 #include "TBits.h"
 #include "TFileMerger.h"
+#include "THashTable.h"
 #include "TMemFile.h"
+#include "TRegexp.h"
 
 #include "mpi.h"
 
+#ifdef TMPI_RNTUPLE
+#include "TMPINTuple.h"
+#endif
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <utility>
 #include <vector>
 
+class TMPIFile;
+
+// In-memory file of one filling thread of a worker. Sync() serializes its
+// batch and queues it in the owning TMPIFile, whose own Sync() sends the
+// batches of all threads as a single message.
+class TMPIThreadFile : public TMemFile {
+
+private:
+  TMPIFile *fOwner;
+  Int_t fIndex; // order of creation, identifies the thread's batches on the collector
+
+public:
+  TMPIThreadFile(TMPIFile *owner, Int_t index, Int_t compress);
+  virtual ~TMPIThreadFile() {}
+
+  void Sync();
+
+  ClassDef(TMPIThreadFile, 0)
+};
+
 class TMPIFile : public TMemFile {
 
 private:
@@ -28,6 +69,8 @@ private:
   Int_t fEndProcess = 0;
   Int_t fSplitLevel;
   Int_t fMPIColor;
+  Int_t fMessageTag = 0; // tag of the messages to the collector, the color by default
+  Long64_t fMMapExtent = 0; // > 0 when the collector output is memory-mapped
 
   Int_t fMPIGlobalRank;
   Int_t fMPIGlobalSize;
@@ -41,6 +84,82 @@ private:
 
   char **argv;
   char *fSendBuf = 0; // Workers' message buffer
+  TBufferPool fBufferPool; // recycles send/receive buffers across syncs
+  TMPIMetrics fMetrics;    // timings and sizes of this rank's syncs/merges
+  TString fMetricsOutput;  // prefix of the per-rank JSON metrics file
+  TMPIWindow *fWindow = 0; // one-sided transport, if enabled
+  TMPILocalGroup *fLocal = 0; // in-process transport between threads, no MPI at all
+  Int_t fLocalInFlight = 0;   // worker: messages the collector has not handed back
+  Int_t fLocalNext = 0;       // collector: worker whose ring is polled first
+  Long64_t fSeq = 0;                   // worker: number of the next message
+  std::map<Int_t, Long64_t> fNextSeq;  //! collector: next expected message per worker
+  Long64_t fResumeSeq = 0;             // worker: messages already merged before a restart
+  Double_t fCheckpointInterval = 0;    // collector: seconds between checkpoints, 0 for none
+  Bool_t fRestart = kFALSE;            // collector: update the checkpointed output
+  std::chrono::high_resolution_clock::time_point fLastCheckpoint; //!
+  Int_t fShipEvery = 1;                // worker: syncs between shipments of non-resettable objects
+  Double_t fShipThreshold = -1;        // worker: relative change of entries shipped in between
+  Long64_t fSyncCount = 0;
+  Bool_t fHeldBack = kFALSE;           // worker: objects left out since their last shipment
+  Bool_t fForceShip = kFALSE;
+  std::map<TString, Double_t> fShippedEntries; //! worker: entries of each object when last shipped
+
+  struct ThreadBuffer_t {
+    std::vector<char> fImage;
+    Long64_t fEntries;
+    Int_t fThread; // index of the thread file
+  };
+  Int_t fThreadFiles = 0;                      // worker: thread files created
+  std::vector<ThreadBuffer_t> fThreadBuffers;  //! worker: batches queued by the thread files
+  std::mutex fThreadMutex;                     //! protects the two above
+
+  // Worker, asynchronous Sync(): the file is written without compression and
+  // a sender thread compresses and sends the batches while the caller keeps
+  // filling.
+  struct AsyncMessage_t {
+    char *fBuf;
+    Int_t fCount;
+    Bool_t fStage; // an uncompressed batch, to be compressed before sending
+  };
+  Bool_t fAsync = kFALSE;
+  Int_t fAsyncDepth = 2;                          // batches queued before Sync() blocks
+  Int_t fAsyncCodec = 0;                          // compression settings of the sent batches
+  std::thread fSender;                            //!
+  std::mutex fSendMutex;                          //! protects the members below
+  std::condition_variable fSendCond;              //!
+  std::deque<AsyncMessage_t> fSendQueue;          //! messages waiting for the sender
+  std::vector<char *> fSent;                      //! sent, to go back to the pool
+  std::vector<std::pair<double, Long64_t>> fStaged; //! compression time and size of the staged batches
+  Bool_t fSending = kFALSE;                       // the sender holds a message
+  Bool_t fSenderStop = kFALSE;
+
+  // Images larger than a chunk are streamed in segments: the worker reads
+  // them straight from its file, the collector spools them to disk.
+  struct SpoolFile {
+    std::unique_ptr<std::ofstream> fOut;
+    TString fName;
+    Long64_t fFirstSeq; // sequence number of the first segment
+    Long64_t fNextSeq;  // expected sequence number of the next segment
+    Long64_t fBytes;
+    Bool_t fBroken;     // a segment is missing, the image is dropped
+  };
+  Long64_t fChunkSize = 0;                 // worker: 0 streams only what one message cannot hold
+  std::map<Int_t, SpoolFile> fSpools;      //! collector: image being received from each worker
+  std::vector<TString> fSpoolFiles;        //! collector: spooled images kept as client files
+
+  Bool_t fSchemaHandshake = kFALSE;
+  UInt_t fSchemaId = 0;                                  // worker: id of the registered schema
+  std::vector<Char_t> fSchemaSent;                       //! worker: streamer infos already registered
+  std::vector<std::pair<TString, Int_t>> fSchemaClasses; //! collector: classes registered by workers
+  std::map<Int_t, UInt_t> fClientSchema;                 //! collector: schema id per worker rank
+
+#ifdef TMPI_RNTUPLE
+  TString fNTupleName;
+  Long64_t fNTupleEntries = 0; // entries of the batch committed by Sync()
+  std::unique_ptr<TMPINTuple::RNTupleModel> fNTupleModel;   //! cloned for the writer of every batch
+  std::unique_ptr<TMPINTuple::RNTupleWriter> fNTupleWriter; //! writer of the current batch
+  void OpenNTupleWriter();
+#endif
 
   struct ParallelFileMerger : public TObject {
   public:
@@ -50,32 +169,138 @@ private:
     TBits fClientsContact;
     UInt_t fNClientsContact;
     ClientColl_t fClients;
+    std::vector<Int_t> fSlots; // client id -> index in fClients, -1 before its first contact
     TTimeStamp fLastMerge;
     TFileMerger fMerger;
+    Bool_t fFastHistMerge = kTRUE; // sum histograms binned alike with TMPIHistMerge
+    Int_t fLastFastMerged = 0;     // histograms the last Merge() summed that way
+    Int_t fMergeEvery = 1;         // messages between full merges
+    Int_t fSinceMerge = 0;         // messages since the last full merge
+    Bool_t fStale = kFALSE;        // non-resettable objects received since the last full merge
     
-    ParallelFileMerger(const char *filename, Int_t compression_settings, Bool_t writeCache = kFALSE);
+    ParallelFileMerger(const char *filename, Int_t compression_settings, Bool_t writeCache = kFALSE, Long64_t mmapExtent = 0, Bool_t update = kFALSE);
     virtual ~ParallelFileMerger();
     
     ULong_t Hash() const;
     const char *GetName() const;
     
     Bool_t InitialMerge(TFile *input);
+    Bool_t NTupleMerge(TFile *input);
     Bool_t Merge();
     Bool_t NeedMerge(Float_t clientThreshold);
     Bool_t NeedFinalMerge();
+    TClientInfo &GetClient(UInt_t clientID);
+    TFile *OpenClientFile(UInt_t clientID, char *buffer, Long64_t size);
     void RegisterClient(UInt_t clientID, TFile *file);
     
     TClientInfo tcl;
   };
 
+public:
+  // Order in which a collector merges the messages it has received:
+  // arrival, smallest buffer, worker served least recently, or rank
+  // round-robin. Each worker's own messages always keep their order.
+  enum EMergePolicy { kFIFO, kSmallestFirst, kLeastRecent, kRoundRobin };
+
+private:
+  struct PendingMessage {
+    char *fBuf;
+    Int_t fBytes;
+    Long64_t fOrder; // arrival number
+    double fProbeTime;
+    std::chrono::high_resolution_clock::time_point fReceived;
+    Bool_t fStreamed; // its stream parts are merged already
+  };
+
+  // Keys routed to an output of their own instead of the main one.
+  struct Stream {
+    TString fName;
+    std::vector<TRegexp> fPatterns; // top-level key names
+    Int_t fMergeEvery;
+    TString fOutput;
+  };
+
+  THashTable fMergers;       // collector: one ParallelFileMerger per output
+  std::vector<Stream> fStreams; //! collector: served before the main output, in order
+  Bool_t fSkipStreams = kFALSE;     // collector: the message being merged was streamed ahead
+  Int_t fMergeEvery = 1;       // collector: messages between full merges of the main output
+  Bool_t fCollecting = kFALSE; // collector: between StartCollector() and FinishCollector()
+  Bool_t fCache = kFALSE;      // collector: write cache on the output
+  Bool_t fDedup = kFALSE;      // collector: skip objects a client resends unchanged
+  Bool_t fFastHistMerge = kTRUE; // collector: vectorized sum of histograms binned alike
+  Long64_t fFullMerges = 0;    // collector: full merges done, and their total time
+  Double_t fFullMergeTime = 0;
+  Bool_t fScheduled = kFALSE;              // collector: merge through the pending queues
+  EMergePolicy fMergePolicy = kFIFO;
+  Long64_t fMaxPendingBytes = 0;           // stop receiving above, 0 for no limit
+  Long64_t fPendingBytes = 0;
+  Long64_t fPendingCount = 0;
+  Long64_t fArrivals = 0;
+  Long64_t fServed = 0;
+  Int_t fLastSource = -1;
+  std::map<Int_t, std::deque<PendingMessage>> fPending; //! received, not merged yet, per worker
+  std::map<Int_t, Long64_t> fLastServed;                //! merge number of each worker's last message
+  Int_t fMsgReceived = 0;
+  std::chrono::high_resolution_clock::time_point fRunStart; //!
+
   void SetOutputName();
   void CheckSplitLevel();
   void SplitMPIComm();
   void UpdateEndProcess(); // update how many workers reached end of job
+  Bool_t RegisterSchema(Int_t source, char *buf, Int_t size);
+  void InjectSchema(TFile *output);
+  void WaitForRequest(); // complete the pending send and recycle its buffer
+  char *AcquireMessage(Long64_t bytes, Long64_t entries, UInt_t flags, Int_t thread = -1);
+  Long64_t CountEntries();
+  Bool_t CheckSequence(Int_t source, const TMPIMessageHeader &header);
+  Bool_t SkipResumed(Long64_t messages = 1);
+  void HoldBackObjects(TDirectory *dir, Bool_t due, std::vector<std::pair<TDirectory *, TObject *>> &held);
+  TString GetCheckpointName() const;
+  Bool_t ReadCheckpointState();
+  void WriteCheckpointState();
+  void Checkpoint();
+  void SendBlocking(const char *buf, Int_t count, Int_t tag);
+  void Transmit(const char *buf, Int_t count, Int_t tag);
+  void QueueSend(char *buf, Int_t count, Bool_t stage = kFALSE);
+  void StageImage(char *image, Long64_t bytes, std::vector<char> &staged, Long64_t reserve);
+  void FlushAsync();
+  void StopSender();
+  void RunSender();
+  void CollectSent();
+  void PutBuffer(const char *buf, Int_t count);
+  void PostSendBuf(Int_t count, Bool_t stage = kFALSE);
+  void SendThreadBuffers();
+  void SendMultipart(std::vector<ThreadBuffer_t> &parts, size_t first, size_t last);
+  void MergeParts(Int_t source, char *buf, Long64_t bytes, std::stringstream &timing_msg);
+  void ReceiveMessage(MPI_Status &status, double probe_time);
+  Bool_t PollWindow(std::chrono::high_resolution_clock::time_point probe_start);
+  Bool_t PollLocal(std::chrono::high_resolution_clock::time_point probe_start);
+  Bool_t PopLocal(Int_t &source, char *&buf, Int_t &count);
+  void ReturnLocal(Int_t source, char *buf, Int_t count);
+  void PushLocal(char *buf, Int_t count);
+  void ReclaimLocal();
+  void HandleMessage(Int_t source, char *buf, Int_t number_bytes, double probe_time);
+  Bool_t ReceivePending(Bool_t block);
+  Bool_t MergePending();
+  void StreamPending();
+  UInt_t ClientId(Int_t source, Int_t thread = -1) const;
+  TString GetOutputName(const char *stream = 0) const;
+  ParallelFileMerger *GetMerger(const TString &output, Int_t mergeEvery);
+  TFile *SplitStream(const Stream &stream, TFile *input, Bool_t copy = kTRUE, Bool_t remove = kTRUE);
+  void MergeInput(ParallelFileMerger *info, UInt_t client, TFile *infile, const char *spool = 0);
+  void FullMerge(ParallelFileMerger *info);
+  void FlushMergers();
+  void MergeBuffer(UInt_t client, char *buf, Long64_t number_bytes, std::stringstream &timing_msg, const char *spool = 0);
+  void AppendChunk(Int_t source, const TMPIMessageHeader &header, char *payload, std::stringstream &timing_msg);
+  void SendChunks(Long64_t bytes, Long64_t entries, Long64_t chunk, const char *image = 0, Int_t thread = -1);
+  void MergeLocal();
 
 public:
   TMPIFile(const char *name, char *buffer, Long64_t size = 0, Option_t *option = "", Int_t split = 1, const char *ftitle = "", Int_t compress = 4);
   TMPIFile(const char *name, Option_t *option = "", Int_t split = 1, const char *ftitle = "", Int_t compress = 4); // no complete implementation
+  // In-process mode: 'rank' 0 of the group is the collector, the others
+  // are workers, each running in its own thread. MPI is not used.
+  TMPIFile(const char *name, TMPILocalGroup *group, Int_t rank, Option_t *option = "RECREATE", const char *ftitle = "", Int_t compress = 4);
   virtual ~TMPIFile();
 
   // some functions on MPI information
@@ -86,18 +311,77 @@ public:
   Int_t GetMPIColor() const;
   Int_t GetSplitLevel() const;
 
+  void SetBufferPool(Long64_t blockSize, Long64_t highWater);
+  const TBufferPool::Stats &GetBufferPoolStats() const;
+  void SetMetricsOutput(const char *prefix);
+  const TMPIMetrics &GetMetrics() const;
+  // Collective over the collector and its workers, before the first Sync().
+  void SetRMATransport(Bool_t enable = kTRUE, Int_t nslots = 0, Long64_t slotSize = 0);
+  // Same on the collector and its workers, before the first Sync().
+  void SetMessageTag(Int_t tag);
+  Int_t GetMessageTag() const;
+  // Collective: flush a readable output every 'interval' seconds and, with
+  // 'restart', continue the run of the last checkpoint. The workers do not
+  // resend their batches, they regenerate them and skip those already
+  // merged: a restart is refused unless the caller states with
+  // 'deterministic' that the job reproduces its batches exactly.
+  void SetCheckpoint(Double_t interval, Bool_t restart = kFALSE, Bool_t deterministic = kFALSE);
+
   // Master Functions
+  void SetMMapOutput(Bool_t enable = kTRUE, Long64_t extent = 0);
+  void SetMergePolicy(EMergePolicy policy, Long64_t maxPendingBytes = 0);
+  void SetKeyDeduplication(Bool_t enable = kTRUE);
+  void SetFastHistogramMerge(Bool_t enable = kTRUE);
+  // Route the top-level keys (objects or directories) matching the wildcard
+  // 'keys' to their own output, <name>_<stream>_<color>.root, merged before
+  // the main one by a merger of their own; calling it again for the same
+  // stream adds keys. Their non-resettable objects are merged again at most
+  // every 'mergeEvery' messages, and at checkpoints and at the end. Before
+  // StartCollector(). A stream turns on the pending queues of
+  // SetMergePolicy(), kFIFO with no pending-bytes limit unless it was called:
+  // the collector receives every message available before merging and
+  // Progress() merges from the queues.
+  void AddStream(const char *stream, const char *keys, Int_t mergeEvery = 1);
+  void SetMergeCadence(Int_t mergeEvery); // same for the main output
   void RunCollector(Bool_t cache = kFALSE);
+  void StartCollector(Bool_t cache = kFALSE);
+  Bool_t Progress(Int_t maxMessages = 1); // merges at most 'maxMessages', 0 for all available
+  void FinishCollector();
   void R__MigrateKey(TDirectory *destination, TDirectory *source);
   void R__DeleteObject(TDirectory *dir, Bool_t withReset);
   Bool_t R__NeedInitialMerge(TDirectory *dir);
+  Bool_t R__NeedMerge(TDirectory *dir);
   Bool_t IsCollector();
 
   // Worker Functions
+  void SetSchemaHandshake(Bool_t enable = kTRUE);
+  void SetHistogramShipping(Int_t every = 1, Double_t threshold = -1);
+  // Sync() returns once the batch is serialized, a background thread sends
+  // it. Needs MPI_THREAD_MULTIPLE, Sync() stays synchronous otherwise.
+  void SetAsyncSync(Bool_t enable = kTRUE, Int_t depth = 2);
+  // Send batches larger than 'chunkSize' bytes as a stream of segments of
+  // that size (at most 1 GB). Larger than 1 GB they always are.
+  void SetChunkSize(Long64_t chunkSize);
+  static const Long64_t kMaxChunkSize = 1024 * 1024 * 1024;
+  UInt_t GetSchemaId() const;
+  virtual void WriteStreamerInfo();
   void CreateBufferAndSend();
   // Empty Buffer to signal the end of job...
   void CreateEmptyBufferAndSend();
   void Sync();
+  void SendBuffer(const char *buffer, Int_t count, Long64_t entries = 0); // replay a serialized image
+  // Hybrid MPI + threads: one file per filling thread. Once one exists,
+  // Sync() sends the batches the threads queued instead of this file's
+  // content; it has to be called by the thread owning MPI.
+  TMPIThreadFile *CreateThreadFile();
+  void QueueThreadBuffer(std::vector<char> &&image, Long64_t entries, Int_t thread);
+#ifdef TMPI_RNTUPLE
+  // Fill an RNTuple instead of (or next to) TTrees. Every Sync() commits
+  // the batch and opens a new writer: entries have to be created again
+  // from GetNTupleWriter() after each Sync().
+  TMPINTuple::RNTupleWriter *CreateNTuple(std::unique_ptr<TMPINTuple::RNTupleModel> model, const char *name);
+  TMPINTuple::RNTupleWriter *GetNTupleWriter() const;
+#endif
 
   // Finalize work and save output in disk.
   void MPIClose();
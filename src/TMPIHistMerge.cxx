@@ -0,0 +1,299 @@
+// @(#)root/io:$Id$
+
+/*************************************************************************
+ * Copyright (C) 1995-2002, Rene Brun and Fons Rademakers.               *
+ * All rights reserved.                                                  *
+ *                                                                       *
+ * For the licensing terms see $ROOTSYS/LICENSE.                         *
+ * For the list of contributors see $ROOTSYS/README/CREDITS.             *
+ *************************************************************************/
+
+#include "TMPIHistMerge.h"
+#include "TClass.h"
+#include "TDirectory.h"
+#include "TH1.h"
+#include "TH2.h"
+#include "TH3.h"
+#include "TKey.h"
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define R__X86_KERNELS
+#include <immintrin.h>
+#endif
+
+ClassImp(TMPIHistMerge);
+
+template <typename T>
+static void R__AddScalar(T *to, const T *from, Long64_t n) {
+  for (Long64_t i = 0; i < n; ++i) {
+    to[i] += from[i];
+  }
+}
+
+#ifdef R__X86_KERNELS
+// Compiled for the instruction set whatever the build flags, only called
+// once the CPU has been checked for it.
+__attribute__((target("avx2"))) static void R__AddAVX2(Double_t *to, const Double_t *from, Long64_t n) {
+  Long64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(to + i, _mm256_add_pd(_mm256_loadu_pd(to + i), _mm256_loadu_pd(from + i)));
+  }
+  R__AddScalar(to + i, from + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void R__AddAVX2(Float_t *to, const Float_t *from, Long64_t n) {
+  Long64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(to + i, _mm256_add_ps(_mm256_loadu_ps(to + i), _mm256_loadu_ps(from + i)));
+  }
+  R__AddScalar(to + i, from + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void R__AddAVX512(Double_t *to, const Double_t *from, Long64_t n) {
+  Long64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm512_storeu_pd(to + i, _mm512_add_pd(_mm512_loadu_pd(to + i), _mm512_loadu_pd(from + i)));
+  }
+  R__AddScalar(to + i, from + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void R__AddAVX512(Float_t *to, const Float_t *from, Long64_t n) {
+  Long64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm512_storeu_ps(to + i, _mm512_add_ps(_mm512_loadu_ps(to + i), _mm512_loadu_ps(from + i)));
+  }
+  R__AddScalar(to + i, from + i, n - i);
+}
+#endif
+
+static TMPIHistMerge::EKernel R__DetectKernel() {
+#ifdef R__X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return TMPIHistMerge::kAVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return TMPIHistMerge::kAVX2;
+  }
+#endif
+  return TMPIHistMerge::kScalar;
+}
+
+TMPIHistMerge::EKernel TMPIHistMerge::GetKernel() {
+  static const EKernel kernel = R__DetectKernel();
+  return kernel;
+}
+
+Bool_t TMPIHistMerge::HasKernel(EKernel kernel) {
+  switch (kernel) {
+  case kAVX512:
+    return GetKernel() == kAVX512;
+  case kAVX2:
+    return GetKernel() != kScalar;
+  default:
+    return kTRUE;
+  }
+}
+
+const char *TMPIHistMerge::GetKernelName(EKernel kernel) {
+  switch (kernel == kAuto ? GetKernel() : kernel) {
+  case kAVX512:
+    return "avx512";
+  case kAVX2:
+    return "avx2";
+  default:
+    return "scalar";
+  }
+}
+
+// A kernel the CPU lacks falls back to the scalar loop.
+void TMPIHistMerge::Add(Double_t *to, const Double_t *from, Long64_t n, EKernel kernel) {
+  kernel = kernel == kAuto ? GetKernel() : kernel;
+#ifdef R__X86_KERNELS
+  if (kernel == kAVX512 && HasKernel(kAVX512)) {
+    R__AddAVX512(to, from, n);
+    return;
+  }
+  if (kernel == kAVX2 && HasKernel(kAVX2)) {
+    R__AddAVX2(to, from, n);
+    return;
+  }
+#endif
+  R__AddScalar(to, from, n);
+}
+
+void TMPIHistMerge::Add(Float_t *to, const Float_t *from, Long64_t n, EKernel kernel) {
+  kernel = kernel == kAuto ? GetKernel() : kernel;
+#ifdef R__X86_KERNELS
+  if (kernel == kAVX512 && HasKernel(kAVX512)) {
+    R__AddAVX512(to, from, n);
+    return;
+  }
+  if (kernel == kAVX2 && HasKernel(kAVX2)) {
+    R__AddAVX2(to, from, n);
+    return;
+  }
+#endif
+  R__AddScalar(to, from, n);
+}
+
+static const TAxis *R__GetAxis(const TH1 *hist, Int_t i) {
+  return i == 0 ? hist->GetXaxis() : (i == 1 ? hist->GetYaxis() : hist->GetZaxis());
+}
+
+// Plain histograms only: profiles and the other derived classes carry more
+// than the bin and Sumw2 arrays.
+static Bool_t R__IsFastClass(const TClass *cl) {
+  return cl == TH1D::Class() || cl == TH1F::Class() || cl == TH2D::Class() ||
+         cl == TH2F::Class() || cl == TH3D::Class() || cl == TH3F::Class();
+}
+
+Bool_t TMPIHistMerge::IsSupported(const TH1 *hist) {
+  if (!hist || !R__IsFastClass(hist->IsA()) || hist->GetBuffer()) {
+    return kFALSE;
+  }
+  // averages are merged as weighted means by TH1::Merge, not summed
+  if (hist->TestBit(TH1::kIsAverage)) {
+    return kFALSE;
+  }
+  for (Int_t i = 0; i < hist->GetDimension(); ++i) {
+    const TAxis *axis = R__GetAxis(hist, i);
+    if (axis->GetLabels() || axis->CanExtend()) {
+      return kFALSE;
+    }
+  }
+  return kTRUE;
+}
+
+Bool_t TMPIHistMerge::SameBinning(const TH1 *a, const TH1 *b) {
+  if (a->GetDimension() != b->GetDimension() || a->GetNcells() != b->GetNcells()) {
+    return kFALSE;
+  }
+  for (Int_t i = 0; i < a->GetDimension(); ++i) {
+    const TAxis *x = R__GetAxis(a, i);
+    const TAxis *y = R__GetAxis(b, i);
+    if (x->GetNbins() != y->GetNbins() || x->GetXmin() != y->GetXmin() || x->GetXmax() != y->GetXmax() ||
+        x->IsVariableBinSize() != y->IsVariableBinSize()) {
+      return kFALSE;
+    }
+    if (x->IsVariableBinSize() &&
+        (x->GetXbins()->GetSize() != y->GetXbins()->GetSize() ||
+         memcmp(x->GetXbins()->GetArray(), y->GetXbins()->GetArray(), x->GetXbins()->GetSize() * sizeof(Double_t)))) {
+      return kFALSE;
+    }
+  }
+  return kTRUE;
+}
+
+Bool_t TMPIHistMerge::AddTo(TH1 *to, const TH1 *from, EKernel kernel) {
+  if (!IsSupported(to) || !IsSupported(from) || to->IsA() != from->IsA() || !SameBinning(to, from) ||
+      to->GetSumw2N() != from->GetSumw2N()) {
+    return kFALSE;
+  }
+  Long64_t n = to->GetNcells();
+  if (const TArrayD *src = dynamic_cast<const TArrayD *>(from)) {
+    TArrayD *dst = dynamic_cast<TArrayD *>(to);
+    if (src->GetSize() != n || dst->GetSize() != n) {
+      return kFALSE;
+    }
+    Add(dst->GetArray(), src->GetArray(), n, kernel);
+  } else {
+    const TArrayF *srcf = dynamic_cast<const TArrayF *>(from);
+    TArrayF *dstf = dynamic_cast<TArrayF *>(to);
+    if (!srcf || srcf->GetSize() != n || dstf->GetSize() != n) {
+      return kFALSE;
+    }
+    Add(dstf->GetArray(), srcf->GetArray(), n, kernel);
+  }
+  if (to->GetSumw2N()) {
+    Add(to->GetSumw2()->GetArray(), from->GetSumw2()->GetArray(), n, kernel);
+  }
+
+  Double_t stats[TH1::kNstat] = {0};
+  Double_t other[TH1::kNstat] = {0};
+  to->GetStats(stats);
+  from->GetStats(other);
+  for (Int_t i = 0; i < TH1::kNstat; ++i) {
+    stats[i] += other[i];
+  }
+  Double_t entries = to->GetEntries() + from->GetEntries();
+  to->PutStats(stats);
+  to->SetEntries(entries);
+  return kTRUE;
+}
+
+// Count every key name of the directory tree.
+static void R__CollectNames(TDirectory *dir, std::unordered_map<std::string, Int_t> &names) {
+  TIter nextkey(dir->GetListOfKeys());
+  TKey *key;
+  while ((key = (TKey *)nextkey())) {
+    names[key->GetName()]++;
+    TClass *cl = TClass::GetClass(key->GetClassName());
+    if (cl && cl->InheritsFrom(TDirectory::Class())) {
+      TDirectory *subdir = dir->GetDirectory(key->GetName());
+      if (subdir) {
+        R__CollectNames(subdir, names);
+      }
+    }
+  }
+}
+
+// TFileMerger skips the keys whose "<name> " appears in its list of names,
+// which also catches any key named like the end of a listed one: a
+// histogram only takes the fast path if no other key of an input matches
+// any of its suffixes.
+static Bool_t R__UniqueName(const std::string &name, const std::unordered_map<std::string, Int_t> &names) {
+  for (size_t start = 0; start < name.size(); ++start) {
+    auto it = names.find(name.substr(start));
+    if (it != names.end() && it->second > (start == 0 ? 1 : 0)) {
+      return kFALSE;
+    }
+  }
+  return kTRUE;
+}
+
+Int_t TMPIHistMerge::MergeDirectory(TDirectory *output, const std::vector<TDirectory *> &inputs,
+                                    std::vector<TString> &merged, EKernel kernel) {
+  if (!output || inputs.empty()) {
+    return 0;
+  }
+  std::vector<std::unordered_map<std::string, Int_t>> names(inputs.size());
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    R__CollectNames(inputs[i], names[i]);
+  }
+
+  Bool_t addDirectory = TH1::AddDirectoryStatus();
+  TH1::AddDirectory(kFALSE);
+  Int_t nmerged = 0;
+  TIter nextkey(inputs[0]->GetListOfKeys());
+  TKey *key;
+  while ((key = (TKey *)nextkey())) {
+    if (!R__IsFastClass(TClass::GetClass(key->GetClassName()))) {
+      continue;
+    }
+    Bool_t ok = kTRUE;
+    for (size_t i = 0; ok && i < inputs.size(); ++i) {
+      ok = R__UniqueName(key->GetName(), names[i]);
+    }
+    TH1 *sum = ok ? (TH1 *)key->ReadObj() : 0;
+    ok = IsSupported(sum);
+    for (size_t i = 1; ok && i < inputs.size(); ++i) {
+      TKey *other = inputs[i]->GetKey(key->GetName());
+      TH1 *hist = other && !strcmp(other->GetClassName(), key->GetClassName()) ? (TH1 *)other->ReadObj() : 0;
+      ok = hist && AddTo(sum, hist, kernel);
+      delete hist;
+    }
+    if (ok) {
+      output->WriteTObject(sum, key->GetName());
+      merged.push_back(key->GetName());
+      nmerged++;
+    }
+    delete sum;
+  }
+  TH1::AddDirectory(addDirectory);
+  return nmerged;
+}
@@ -0,0 +1,54 @@
+// @(#)root/io:$Id$
+
+/*************************************************************************
+ * Copyright (C) 1995-2009, Rene Brun and Fons Rademakers.               *
+ * All rights reserved.                                                  *
+ *                                                                       *
+ * For the licensing terms see $ROOTSYS/LICENSE.                         *
+ * For the list of contributors see $ROOTSYS/README/CREDITS.             *
+ *************************************************************************/
+
+#ifndef ROOT_TMPIHistMerge
+#define ROOT_TMPIHistMerge
+
+#include "Rtypes.h"
+#include "TString.h"
+
+#include <vector>
+
+class TDirectory;
+class TH1;
+
+// Fast path of the collector for histograms binned the same way in every
+// client: the bin contents and Sumw2 arrays are summed with vectorized adds
+// (AVX-512 or AVX2 when the CPU has them, scalar otherwise) instead of going
+// through TH1::Merge. Fixed and variable bins of TH1/TH2/TH3 with float or
+// double contents are handled; profiles, averages (kIsAverage), labelled or
+// extendable axes and unflushed fill buffers are left to TFileMerger.
+class TMPIHistMerge {
+
+public:
+  enum EKernel { kAuto, kScalar, kAVX2, kAVX512 };
+
+  static EKernel GetKernel(); // what kAuto selects on this CPU
+  static Bool_t HasKernel(EKernel kernel);
+  static const char *GetKernelName(EKernel kernel);
+
+  static void Add(Double_t *to, const Double_t *from, Long64_t n, EKernel kernel = kAuto);
+  static void Add(Float_t *to, const Float_t *from, Long64_t n, EKernel kernel = kAuto);
+
+  static Bool_t IsSupported(const TH1 *hist);
+  static Bool_t SameBinning(const TH1 *a, const TH1 *b);
+  // Add the bins, Sumw2, statistics and entries of 'from' to 'to'; false,
+  // leaving 'to' untouched, if the fast path does not apply.
+  static Bool_t AddTo(TH1 *to, const TH1 *from, EKernel kernel = kAuto);
+
+  // Sum the top-level histograms of 'inputs' that the fast path can merge
+  // in all of them and write the results to 'output'. Their names go to
+  // 'merged', for TFileMerger to skip. Returns their number.
+  static Int_t MergeDirectory(TDirectory *output, const std::vector<TDirectory *> &inputs,
+                              std::vector<TString> &merged, EKernel kernel = kAuto);
+
+  ClassDef(TMPIHistMerge, 0)
+};
+#endif
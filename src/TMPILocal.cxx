@@ -0,0 +1,86 @@
+// @(#)root/io:$Id$
+
+/*************************************************************************
+ * Copyright (C) 1995-2002, Rene Brun and Fons Rademakers.               *
+ * All rights reserved.                                                  *
+ *                                                                       *
+ * For the licensing terms see $ROOTSYS/LICENSE.                         *
+ * For the list of contributors see $ROOTSYS/README/CREDITS.             *
+ *************************************************************************/
+
+#include "TMPILocal.h"
+#include "TError.h"
+#include "TROOT.h"
+
+#include <cstdlib>
+
+ClassImp(TMPIRing);
+ClassImp(TMPILocalGroup);
+
+TMPIRing::TMPIRing(Int_t capacity) : fHead(0), fTail(0)
+{
+  // rounded up to a power of two so that slots are found with a mask
+  Int_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  fSlots.resize(size);
+  fMask = size - 1;
+}
+
+Bool_t TMPIRing::Push(char *buffer, Int_t count)
+{
+  ULong64_t tail = fTail.load(std::memory_order_relaxed);
+  if (tail - fHead.load(std::memory_order_acquire) == fSlots.size()) {
+    return kFALSE;
+  }
+  fSlots[tail & fMask] = std::make_pair(buffer, count);
+  fTail.store(tail + 1, std::memory_order_release);
+  return kTRUE;
+}
+
+Bool_t TMPIRing::Pop(char *&buffer, Int_t &count)
+{
+  ULong64_t head = fHead.load(std::memory_order_relaxed);
+  if (head == fTail.load(std::memory_order_acquire)) {
+    return kFALSE;
+  }
+  buffer = fSlots[head & fMask].first;
+  count = fSlots[head & fMask].second;
+  fHead.store(head + 1, std::memory_order_release);
+  return kTRUE;
+}
+
+TMPILocalGroup::TMPILocalGroup(Int_t nworkers, Int_t depth)
+    : fSize(nworkers + 1), fDepth(depth > 0 ? depth : kDefaultDepth)
+{
+  if (nworkers < 1) {
+    SysError("TMPILocalGroup", "at least one worker is required instead of %d", nworkers);
+    exit(1);
+  }
+  // every rank will be a thread of this process, each with its own files;
+  // this has to happen before any of them starts
+  ROOT::EnableThreadSafety();
+  // rank 0, the collector, has no rings of its own
+  for (Int_t rank = 0; rank < fSize; rank++) {
+    fToCollector.emplace_back(new TMPIRing(fDepth));
+    fToWorker.emplace_back(new TMPIRing(fDepth));
+  }
+}
+
+void TMPILocalGroup::PublishResume(const std::vector<Long64_t> &resume)
+{
+  {
+    std::lock_guard<std::mutex> lock(fResumeMutex);
+    fResume = resume;
+    fResumeReady = kTRUE;
+  }
+  fResumeCond.notify_all();
+}
+
+Long64_t TMPILocalGroup::WaitResume(Int_t rank)
+{
+  std::unique_lock<std::mutex> lock(fResumeMutex);
+  fResumeCond.wait(lock, [this] { return fResumeReady; });
+  return rank < (Int_t)fResume.size() ? fResume[rank] : 0;
+}
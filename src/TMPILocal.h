@@ -0,0 +1,82 @@
+// @(#)root/io:$Id$
+
+/*************************************************************************
+ * Copyright (C) 1995-2009, Rene Brun and Fons Rademakers.               *
+ * All rights reserved.                                                  *
+ *                                                                       *
+ * For the licensing terms see $ROOTSYS/LICENSE.                         *
+ * For the list of contributors see $ROOTSYS/README/CREDITS.             *
+ *************************************************************************/
+
+#ifndef ROOT_TMPILocal
+#define ROOT_TMPILocal
+
+#include "Rtypes.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Lock-free ring of messages between exactly one producer thread and one
+// consumer thread. The buffers are passed, not copied.
+class TMPIRing {
+
+private:
+  std::vector<std::pair<char *, Int_t>> fSlots; //!
+  ULong64_t fMask;
+  std::atomic<ULong64_t> fHead; //! next slot to pop, written by the consumer
+  char fPad[64];                //! keeps the two counters on separate cache lines
+  std::atomic<ULong64_t> fTail; //! next slot to push, written by the producer
+
+public:
+  TMPIRing(Int_t capacity);
+  virtual ~TMPIRing() {}
+
+  Bool_t Push(char *buffer, Int_t count);
+  Bool_t Pop(char *&buffer, Int_t &count);
+  Int_t GetCapacity() const { return fSlots.size(); }
+
+  ClassDef(TMPIRing, 0)
+};
+
+// In-process replacement of MPI for single-node runs: the collector (rank
+// 0) and the workers (ranks 1 to n) are threads of one process, each with
+// its own TMPIFile built on the same group. Every worker has a ring of
+// messages to the collector and a ring bringing the merged buffers back to
+// its pool, so that neither a lock nor a copy is involved. The group has to
+// be created before the threads are started.
+class TMPILocalGroup {
+
+private:
+  Int_t fSize;
+  Int_t fDepth;
+  std::vector<std::unique_ptr<TMPIRing>> fToCollector; //!
+  std::vector<std::unique_ptr<TMPIRing>> fToWorker;    //!
+
+  // one-shot handover of the checkpointed state, see TMPIFile::SetCheckpoint
+  std::mutex fResumeMutex;              //!
+  std::condition_variable fResumeCond;  //!
+  std::vector<Long64_t> fResume;        //!
+  Bool_t fResumeReady = kFALSE;
+
+public:
+  static const Int_t kDefaultDepth = 4;
+
+  // 'depth': messages a worker can have in flight before Sync() waits.
+  TMPILocalGroup(Int_t nworkers, Int_t depth = kDefaultDepth);
+  virtual ~TMPILocalGroup() {}
+
+  Int_t GetSize() const { return fSize; }
+  Int_t GetDepth() const { return fDepth; }
+  TMPIRing &ToCollector(Int_t rank) { return *fToCollector[rank]; }
+  TMPIRing &ToWorker(Int_t rank) { return *fToWorker[rank]; }
+
+  void PublishResume(const std::vector<Long64_t> &resume);
+  Long64_t WaitResume(Int_t rank);
+
+  ClassDef(TMPILocalGroup, 0)
+};
+#endif
@@ -0,0 +1,39 @@
+// @(#)root/io:$Id$
+
+/*************************************************************************
+ * Copyright (C) 1995-2009, Rene Brun and Fons Rademakers.               *
+ * All rights reserved.                                                  *
+ *                                                                       *
+ * For the licensing terms see $ROOTSYS/LICENSE.                         *
+ * For the list of contributors see $ROOTSYS/README/CREDITS.             *
+ *************************************************************************/
+
+#ifndef ROOT_TMPIMessage
+#define ROOT_TMPIMessage
+
+#include "Rtypes.h"
+
+// Fixed header in front of every message from a worker to its collector.
+// Workers and collectors run the same binary on the same kind of node, it
+// is sent as is.
+struct TMPIMessageHeader {
+  enum EFlags {
+    kEndOfJob = BIT(0), // last message of the worker, no payload
+    kSchema = BIT(1),   // payload is a schema registration, not a file image
+    kMultipart = BIT(2), // payload is a part table followed by several file images
+    kChunk = BIT(3),     // payload is the next segment of a streamed file image
+    kLastChunk = BIT(4), // with kChunk, the segment completing the image
+  };
+  static const UInt_t kMagic = 0x544d5049; // "TMPI"
+
+  UInt_t fMagic = kMagic;
+  Int_t fWorker = 0;    // rank of the sender in the collector's communicator
+  Long64_t fSeq = 0;    // number of the message for this worker, from 0
+  Long64_t fBytes = 0;  // payload size
+  Long64_t fEntries = 0; // entries of the batch (largest tree or RNTuple)
+  Int_t fCodec = 0;     // compression settings of the payload
+  UInt_t fFlags = 0;
+  UInt_t fSchemaId = 0; // schema handshake the payload relies on, 0 for none
+  Int_t fThread = -1;   // thread file of a streamed image, -1 for the worker's own
+};
+#endif
@@ -0,0 +1,96 @@
+// @(#)root/io:$Id$
+
+/*************************************************************************
+ * Copyright (C) 1995-2002, Rene Brun and Fons Rademakers.               *
+ * All rights reserved.                                                  *
+ *                                                                       *
+ * For the licensing terms see $ROOTSYS/LICENSE.                         *
+ * For the list of contributors see $ROOTSYS/README/CREDITS.             *
+ *************************************************************************/
+
+#include "TMPIMetrics.h"
+#include "TError.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+
+ClassImp(TMPIMetrics);
+
+Long64_t TMPIMetrics::GetCounter(const char *name) const {
+  auto it = fCounters.find(name);
+  return it == fCounters.end() ? 0 : it->second;
+}
+
+const std::vector<Double_t> &TMPIMetrics::GetSamples(const char *name) const {
+  static const std::vector<Double_t> empty;
+  auto it = fSamples.find(name);
+  return it == fSamples.end() ? empty : it->second;
+}
+
+void TMPIMetrics::Clear() {
+  fCounters.clear();
+  fSamples.clear();
+}
+
+// Linear interpolation between the closest ranks of a sorted series.
+static Double_t Quantile(const std::vector<Double_t> &sorted, Double_t q) {
+  Double_t pos = q * (sorted.size() - 1);
+  size_t low = (size_t)pos;
+  size_t high = std::min(low + 1, sorted.size() - 1);
+  return sorted[low] + (pos - low) * (sorted[high] - sorted[low]);
+}
+
+Bool_t TMPIMetrics::WriteJSON(const char *filename) const {
+  std::ofstream out(filename);
+  if (!out) {
+    SysError("WriteJSON", "cannot open %s", filename);
+    return kFALSE;
+  }
+  out << std::setprecision(10);
+
+  out << "{\n  \"info\": {";
+  const char *sep = "";
+  for (auto &info : fInfo) {
+    out << sep << "\n    \"" << info.first << "\": " << info.second;
+    sep = ",";
+  }
+  out << "\n  },\n  \"counters\": {";
+  sep = "";
+  for (auto &counter : fCounters) {
+    out << sep << "\n    \"" << counter.first << "\": " << counter.second;
+    sep = ",";
+  }
+  out << "\n  },\n  \"samples\": {";
+  sep = "";
+  for (auto &series : fSamples) {
+    const std::vector<Double_t> &values = series.second;
+    std::vector<Double_t> sorted(values);
+    std::sort(sorted.begin(), sorted.end());
+    Double_t sum = 0, sum2 = 0;
+    for (Double_t v : values) {
+      sum += v;
+      sum2 += v * v;
+    }
+    Double_t n = values.size();
+    Double_t mean = n ? sum / n : 0;
+    Double_t sigma = n ? std::sqrt(std::max(0., sum2 / n - mean * mean)) : 0;
+
+    out << sep << "\n    \"" << series.first << "\": {\"count\": " << values.size();
+    if (!values.empty()) {
+      out << ", \"mean\": " << mean << ", \"sigma\": " << sigma
+          << ", \"min\": " << sorted.front() << ", \"p50\": " << Quantile(sorted, 0.5)
+          << ", \"p90\": " << Quantile(sorted, 0.9) << ", \"p99\": " << Quantile(sorted, 0.99)
+          << ", \"max\": " << sorted.back();
+    }
+    out << ", \"values\": [";
+    for (size_t i = 0; i < values.size(); ++i) {
+      out << (i ? ", " : "") << values[i];
+    }
+    out << "]}";
+    sep = ",";
+  }
+  out << "\n  }\n}\n";
+  return out.good();
+}
@@ -0,0 +1,47 @@
+// @(#)root/io:$Id$
+
+/*************************************************************************
+ * Copyright (C) 1995-2009, Rene Brun and Fons Rademakers.               *
+ * All rights reserved.                                                  *
+ *                                                                       *
+ * For the licensing terms see $ROOTSYS/LICENSE.                         *
+ * For the list of contributors see $ROOTSYS/README/CREDITS.             *
+ *************************************************************************/
+
+#ifndef ROOT_TMPIMetrics
+#define ROOT_TMPIMetrics
+
+#include "Rtypes.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Per-rank record of the timings and sizes seen by a TMPIFile: named
+// sample series (one value per sync or message), counters, and a few
+// integer properties describing the rank. Written out as one JSON document
+// so that scaling studies do not have to scrape stdout.
+class TMPIMetrics {
+
+private:
+  std::map<std::string, Long64_t> fInfo;
+  std::map<std::string, Long64_t> fCounters;
+  std::map<std::string, std::vector<Double_t>> fSamples;
+
+public:
+  TMPIMetrics() {}
+  virtual ~TMPIMetrics() {}
+
+  void SetInfo(const char *name, Long64_t value) { fInfo[name] = value; }
+  void Add(const char *name, Long64_t value = 1) { fCounters[name] += value; }
+  void Fill(const char *name, Double_t value) { fSamples[name].push_back(value); }
+
+  Long64_t GetCounter(const char *name) const;
+  const std::vector<Double_t> &GetSamples(const char *name) const;
+  void Clear();
+
+  Bool_t WriteJSON(const char *filename) const;
+
+  ClassDef(TMPIMetrics, 0)
+};
+#endif
@@ -0,0 +1,33 @@
+// @(#)root/io:$Id$
+
+/*************************************************************************
+ * Copyright (C) 1995-2009, Rene Brun and Fons Rademakers.               *
+ * All rights reserved.                                                  *
+ *                                                                       *
+ * For the licensing terms see $ROOTSYS/LICENSE.                         *
+ * For the list of contributors see $ROOTSYS/README/CREDITS.             *
+ *************************************************************************/
+
+#ifndef ROOT_TMPINTuple
+#define ROOT_TMPINTuple
+
+// RNTuple support, built with -DTMPI_RNTUPLE=ON. The collectors append the
+// workers' RNTuples through TFileMerger's incremental RNTuple merge, which
+// needs ROOT 6.34; the writer classes left ROOT::Experimental in 6.36.
+
+#include "RVersion.h"
+
+#if ROOT_VERSION_CODE < ROOT_VERSION(6, 34, 0)
+#error "The RNTuple mode of TMPIFile requires ROOT 6.34 or later"
+#endif
+
+#include <ROOT/RNTupleModel.hxx>
+#include <ROOT/RNTupleWriter.hxx>
+
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6, 36, 0)
+namespace TMPINTuple = ROOT;
+#else
+namespace TMPINTuple = ROOT::Experimental;
+#endif
+
+#endif
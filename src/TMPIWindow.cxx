@@ -0,0 +1,145 @@
+// @(#)root/io:$Id$
+
+/*************************************************************************
+ * Copyright (C) 1995-2002, Rene Brun and Fons Rademakers.               *
+ * All rights reserved.                                                  *
+ *                                                                       *
+ * For the licensing terms see $ROOTSYS/LICENSE.                         *
+ * For the list of contributors see $ROOTSYS/README/CREDITS.             *
+ *************************************************************************/
+
+#include "TMPIWindow.h"
+#include "TError.h"
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+ClassImp(TMPIWindow);
+
+const Int_t COLLECTOR = 0;
+
+TMPIWindow::TMPIWindow(MPI_Comm comm, Int_t nslots, Long64_t slotSize)
+    : fComm(comm), fWin(MPI_WIN_NULL), fNSlots(nslots > 0 ? nslots : kDefaultSlots),
+      fSlotSize(slotSize > 0 ? slotSize : kDefaultSlotSize)
+{
+  MPI_Comm_rank(fComm, &fRank);
+  MPI_Aint size = fRank == COLLECTOR ? DataOffset(fNSlots) : 0;
+  if (MPI_Win_allocate(size, 1, MPI_INFO_NULL, fComm, &fBase, &fWin) != MPI_SUCCESS) {
+    SysError("TMPIWindow", "cannot allocate a window of %lld bytes", (Long64_t)size);
+    exit(1);
+  }
+  if (fRank == COLLECTOR) {
+    // ticket counter and every slot free for turn 0
+    memset(fBase, 0, DataOffset(0));
+  }
+  MPI_Barrier(fComm);
+  MPI_Win_lock_all(0, fWin);
+}
+
+TMPIWindow::~TMPIWindow()
+{
+  if (fWin != MPI_WIN_NULL) {
+    MPI_Win_unlock_all(fWin);
+    MPI_Win_free(&fWin);
+  }
+}
+
+// Word 0 is the ticket counter, the slot headers follow, then the data.
+MPI_Aint TMPIWindow::HeaderOffset(Int_t slot, Int_t word) const
+{
+  return (1 + (MPI_Aint)slot * kHeaderWords + word) * sizeof(Long64_t);
+}
+
+MPI_Aint TMPIWindow::DataOffset(Int_t slot) const
+{
+  MPI_Aint header = (HeaderOffset(fNSlots, 0) + 63) / 64 * 64;
+  return header + (MPI_Aint)slot * fSlotSize;
+}
+
+// Atomic read, also on the collector's own memory: a plain load would not
+// be ordered with the workers' updates.
+Long64_t TMPIWindow::FetchState(Int_t slot)
+{
+  Long64_t state;
+  MPI_Fetch_and_op(0, &state, MPI_INT64_T, COLLECTOR, HeaderOffset(slot, kState), MPI_NO_OP, fWin);
+  MPI_Win_flush(COLLECTOR, fWin);
+  return state;
+}
+
+void TMPIWindow::SetState(Int_t slot, Long64_t state)
+{
+  MPI_Accumulate(&state, 1, MPI_INT64_T, COLLECTOR, HeaderOffset(slot, kState), 1, MPI_INT64_T,
+                 MPI_REPLACE, fWin);
+  MPI_Win_flush(COLLECTOR, fWin);
+}
+
+Bool_t TMPIWindow::Put(const char *buffer, Int_t count, Int_t tag)
+{
+  if (fRank == COLLECTOR) {
+    SysError("Put", " should not be called by a collector");
+    exit(1);
+  }
+  Long64_t one = 1;
+  Long64_t ticket;
+  MPI_Fetch_and_op(&one, &ticket, MPI_INT64_T, COLLECTOR, 0, MPI_SUM, fWin);
+  MPI_Win_flush(COLLECTOR, fWin);
+  Int_t slot = ticket % fNSlots;
+  Long64_t turn = ticket / fNSlots;
+
+  // Wait for the collector to hand the slot back from the previous turn.
+  Int_t backoff = 1;
+  while (FetchState(slot) != 2 * turn) {
+    std::this_thread::sleep_for(std::chrono::microseconds(backoff));
+    backoff = backoff < 1000 ? 2 * backoff : backoff;
+  }
+
+  Bool_t fits = count <= fSlotSize;
+  Long64_t header[kHeaderWords - 1] = {count, tag, fRank};
+  MPI_Put(header, kHeaderWords - 1, MPI_INT64_T, COLLECTOR, HeaderOffset(slot, kSize),
+          kHeaderWords - 1, MPI_INT64_T, fWin);
+  if (fits && count > 0) {
+    MPI_Put(buffer, count, MPI_CHAR, COLLECTOR, DataOffset(slot), count, MPI_CHAR, fWin);
+  }
+  // The payload has to be complete before the slot is marked ready.
+  MPI_Win_flush(COLLECTOR, fWin);
+  SetState(slot, 2 * turn + 1);
+  return fits;
+}
+
+Bool_t TMPIWindow::Poll(Int_t &source, Int_t &tag, char *&buffer, Int_t &count)
+{
+  if (fRank != COLLECTOR) {
+    SysError("Poll", " should not be called by a worker");
+    exit(1);
+  }
+  if (fPending) {
+    Release();
+  }
+  Int_t slot = fNextTicket % fNSlots;
+  Long64_t turn = fNextTicket / fNSlots;
+  if (FetchState(slot) != 2 * turn + 1) {
+    return kFALSE;
+  }
+  // make the workers' puts visible to local loads
+  MPI_Win_sync(fWin);
+  const Long64_t *header = (const Long64_t *)(fBase + HeaderOffset(slot, 0));
+  count = header[kSize];
+  tag = header[kTag];
+  source = header[kSource];
+  buffer = count <= fSlotSize ? fBase + DataOffset(slot) : 0;
+  fPending = kTRUE;
+  return kTRUE;
+}
+
+void TMPIWindow::Release()
+{
+  if (!fPending) {
+    return;
+  }
+  Int_t slot = fNextTicket % fNSlots;
+  Long64_t turn = fNextTicket / fNSlots;
+  SetState(slot, 2 * (turn + 1));
+  fNextTicket++;
+  fPending = kFALSE;
+}
@@ -0,0 +1,74 @@
+// @(#)root/io:$Id$
+
+/*************************************************************************
+ * Copyright (C) 1995-2009, Rene Brun and Fons Rademakers.               *
+ * All rights reserved.                                                  *
+ *                                                                       *
+ * For the licensing terms see $ROOTSYS/LICENSE.                         *
+ * For the list of contributors see $ROOTSYS/README/CREDITS.             *
+ *************************************************************************/
+
+#ifndef ROOT_TMPIWindow
+#define ROOT_TMPIWindow
+
+#include "Rtypes.h"
+
+#include "mpi.h"
+
+#include <vector>
+
+// One-sided transport between the workers of a communicator and its rank 0
+// (the collector). The collector exposes an RMA window with a ticket
+// counter and a ring of fixed-size slots. A worker takes a ticket with
+// MPI_Fetch_and_op, waits for its slot to be free for that turn, puts the
+// message into it and marks it ready with an atomic update; the collector
+// consumes the slots in ticket order and hands them back. Messages larger
+// than a slot only carry their size in the slot, the payload follows as a
+// regular two-sided message.
+class TMPIWindow {
+
+private:
+  MPI_Comm fComm;
+  MPI_Win fWin;
+  Int_t fRank;
+  Int_t fNSlots;
+  Long64_t fSlotSize;
+  char *fBase = 0;          // collector: local window memory
+  Long64_t fNextTicket = 0; // collector: next message to consume
+  Bool_t fPending = kFALSE; // collector: last polled slot not released yet
+
+  // Per slot header: state, size, tag, source. The state is 2 * turn while
+  // the slot is free for the message of that turn, 2 * turn + 1 once it
+  // holds it.
+  enum { kState = 0, kSize, kTag, kSource, kHeaderWords };
+
+  MPI_Aint HeaderOffset(Int_t slot, Int_t word) const;
+  MPI_Aint DataOffset(Int_t slot) const;
+  Long64_t FetchState(Int_t slot);
+  void SetState(Int_t slot, Long64_t state);
+
+public:
+  static const Int_t kDefaultSlots = 16;
+  static const Long64_t kDefaultSlotSize = 16 * 1024 * 1024;
+
+  // Collective over 'comm'.
+  TMPIWindow(MPI_Comm comm, Int_t nslots = kDefaultSlots, Long64_t slotSize = kDefaultSlotSize);
+  virtual ~TMPIWindow(); // collective as well
+
+  Int_t GetNSlots() const { return fNSlots; }
+  Long64_t GetSlotSize() const { return fSlotSize; }
+
+  // Worker: deliver a message, blocking until it is in a slot. Returns
+  // false if it did not fit: the caller then sends the payload with
+  // MPI_Send(buffer, count, MPI_CHAR, 0, tag, comm).
+  Bool_t Put(const char *buffer, Int_t count, Int_t tag);
+
+  // Collector: the next message if it has arrived. 'buffer' is 0 for an
+  // oversized message, whose payload has to be received two-sided. The
+  // slot stays valid until Release().
+  Bool_t Poll(Int_t &source, Int_t &tag, char *&buffer, Int_t &count);
+  void Release();
+
+  ClassDef(TMPIWindow, 0)
+};
+#endif
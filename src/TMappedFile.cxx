@@ -0,0 +1,212 @@
+// @(#)root/io:$Id$
+
+/*************************************************************************
+ * Copyright (C) 1995-2002, Rene Brun and Fons Rademakers.               *
+ * All rights reserved.                                                  *
+ *                                                                       *
+ * For the licensing terms see $ROOTSYS/LICENSE.                         *
+ * For the list of contributors see $ROOTSYS/README/CREDITS.             *
+ *************************************************************************/
+
+#include "TMappedFile.h"
+#include "TROOT.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ClassImp(TMappedFile);
+
+// The TFile constructor is told this is a "WEB" file so that it does not
+// open anything itself; the actual open goes through our SysOpen (the same
+// trick TMemFile uses, since virtual calls do not dispatch from the base
+// constructor).
+TMappedFile::TMappedFile(const char *name, Option_t *option,
+                         const char *ftitle, Int_t compress, Long64_t extent)
+    : TFile(name, "WEB", ftitle, compress), fExtent(extent)
+{
+  if (fExtent <= 0) {
+    fExtent = kDefaultExtent;
+  }
+  Long64_t page = sysconf(_SC_PAGESIZE);
+  fExtent = ((fExtent + page - 1) / page) * page;
+
+  fOption = option;
+  fOption.ToUpper();
+  if (fOption == "NEW") {
+    fOption = "CREATE";
+  }
+  Bool_t create = (fOption == "CREATE");
+  Bool_t recreate = (fOption == "RECREATE");
+  Bool_t update = (fOption == "UPDATE");
+  if (!create && !recreate && !update) {
+    Error("TMappedFile", "option %s is not supported, use CREATE, RECREATE or UPDATE", option);
+    MakeZombie();
+    gDirectory = gROOT;
+    return;
+  }
+
+  Int_t flags = O_RDWR | O_CREAT;
+  if (create) {
+    flags |= O_EXCL;
+  } else if (recreate) {
+    flags |= O_TRUNC;
+  }
+  fD = SysOpen(name, flags, 0644);
+  if (fD == -1) {
+    SysError("TMappedFile", "file %s can not be opened", name);
+    MakeZombie();
+    gDirectory = gROOT;
+    return;
+  }
+  fWritable = kTRUE;
+
+  Init(create || recreate);
+}
+
+TMappedFile::~TMappedFile() {
+  // TFile::~TFile would close through TFile::SysClose, so close here.
+  Close();
+}
+
+Bool_t TMappedFile::Reserve(Long64_t size) {
+  if (size <= fCapacity) {
+    return kTRUE;
+  }
+  Long64_t capacity = ((size + fExtent - 1) / fExtent) * fExtent;
+  if (ftruncate(fD, capacity) != 0) {
+    SysError("Reserve", "cannot grow %s to %lld bytes", GetName(), capacity);
+    return kFALSE;
+  }
+  void *map = MAP_FAILED;
+#ifdef __linux__
+  if (fMap) {
+    map = mremap(fMap, fCapacity, capacity, MREMAP_MAYMOVE);
+  }
+#endif
+  if (map == MAP_FAILED) {
+    Unmap();
+    map = mmap(0, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fD, 0);
+    if (map == MAP_FAILED) {
+      SysError("Reserve", "cannot map %lld bytes of %s", capacity, GetName());
+      return kFALSE;
+    }
+  }
+  fMap = (char *)map;
+  fCapacity = capacity;
+  // Baskets are appended, only the tail of the file is hot.
+  madvise(fMap, fCapacity, MADV_SEQUENTIAL);
+  return kTRUE;
+}
+
+void TMappedFile::Unmap() {
+  if (fMap) {
+    munmap(fMap, fCapacity);
+    fMap = 0;
+  }
+  fCapacity = 0;
+  fSynced = 0;
+}
+
+Int_t TMappedFile::SysOpen(const char *pathname, Int_t flags, UInt_t mode) {
+  Int_t fd = ::open(pathname, flags, mode);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat sbuf;
+  if (fstat(fd, &sbuf) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  fD = fd;
+  fSize = sbuf.st_size;
+  fSysOffset = 0;
+  if (!Reserve(fSize > 0 ? fSize : 1)) {
+    ::close(fd);
+    fD = -1;
+    return -1;
+  }
+  return fd;
+}
+
+Int_t TMappedFile::SysClose(Int_t fd) {
+  if (fd < 0) {
+    return 0;
+  }
+  if (fMap) {
+    msync(fMap, fSize, MS_ASYNC);
+  }
+  Unmap();
+  // Drop the unused part of the last extent.
+  Int_t result = ftruncate(fd, fSize);
+  if (::close(fd) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+Int_t TMappedFile::SysRead(Int_t /* fd */, void *buf, Int_t len) {
+  if (fSysOffset >= fSize) {
+    return 0;
+  }
+  Long64_t avail = fSize - fSysOffset;
+  if (len > avail) {
+    len = avail;
+  }
+  memcpy(buf, fMap + fSysOffset, len);
+  fSysOffset += len;
+  return len;
+}
+
+Int_t TMappedFile::SysWrite(Int_t /* fd */, const void *buf, Int_t len) {
+  if (!Reserve(fSysOffset + len)) {
+    errno = ENOSPC;
+    return -1;
+  }
+  memcpy(fMap + fSysOffset, buf, len);
+  fSysOffset += len;
+  if (fSysOffset > fSize) {
+    fSize = fSysOffset;
+  }
+  return len;
+}
+
+Long64_t TMappedFile::SysSeek(Int_t /* fd */, Long64_t offset, Int_t whence) {
+  switch (whence) {
+  case SEEK_SET:
+    fSysOffset = offset;
+    break;
+  case SEEK_CUR:
+    fSysOffset += offset;
+    break;
+  case SEEK_END:
+    fSysOffset = fSize + offset;
+    break;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+  return fSysOffset;
+}
+
+Int_t TMappedFile::SysStat(Int_t /* fd */, Long_t * /* id */, Long64_t *size,
+                           Long_t * /* flags */, Long_t * /* modtime */) {
+  *size = fSize;
+  return 0;
+}
+
+Int_t TMappedFile::SysSync(Int_t /* fd */) {
+  // Schedule write-back of everything written since the previous sync and
+  // return without waiting for the I/O to complete.
+  if (!fMap || fSize <= fSynced) {
+    return 0;
+  }
+  Long64_t page = sysconf(_SC_PAGESIZE);
+  Long64_t begin = (fSynced / page) * page;
+  Int_t result = msync(fMap + begin, fSize - begin, MS_ASYNC);
+  fSynced = fSize;
+  return result;
+}
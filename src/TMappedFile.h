@@ -0,0 +1,53 @@
+// @(#)root/io:$Id$
+
+/*************************************************************************
+ * Copyright (C) 1995-2009, Rene Brun and Fons Rademakers.               *
+ * All rights reserved.                                                  *
+ *                                                                       *
+ * For the licensing terms see $ROOTSYS/LICENSE.                         *
+ * For the list of contributors see $ROOTSYS/README/CREDITS.             *
+ *************************************************************************/
+
+#ifndef ROOT_TMappedFile
+#define ROOT_TMappedFile
+
+#include "TFile.h"
+
+// TMappedFile is a write-oriented TFile whose system I/O layer is backed by
+// a shared mmap of the output file instead of write(2) calls. The mapping
+// is grown in large extents, so merged baskets are copied straight into
+// the page cache and flushed asynchronously with msync(MS_ASYNC).
+class TMappedFile : public TFile {
+
+private:
+  char *fMap = 0;          // start of the shared mapping
+  Long64_t fCapacity = 0;  // bytes currently mapped (and allocated on disk)
+  Long64_t fSize = 0;      // logical size of the file
+  Long64_t fSysOffset = 0; // current position of the system file pointer
+  Long64_t fExtent;        // growth step of the mapping
+  Long64_t fSynced = 0;    // end of the region already scheduled by msync
+
+  Bool_t Reserve(Long64_t size);
+  void Unmap();
+
+protected:
+  virtual Int_t SysOpen(const char *pathname, Int_t flags, UInt_t mode);
+  virtual Int_t SysClose(Int_t fd);
+  virtual Int_t SysRead(Int_t fd, void *buf, Int_t len);
+  virtual Int_t SysWrite(Int_t fd, const void *buf, Int_t len);
+  virtual Long64_t SysSeek(Int_t fd, Long64_t offset, Int_t whence);
+  virtual Int_t SysStat(Int_t fd, Long_t *id, Long64_t *size, Long_t *flags, Long_t *modtime);
+  virtual Int_t SysSync(Int_t fd);
+
+public:
+  static const Long64_t kDefaultExtent = 256 * 1024 * 1024;
+
+  TMappedFile(const char *name, Option_t *option = "RECREATE", const char *ftitle = "", Int_t compress = 4, Long64_t extent = kDefaultExtent);
+  virtual ~TMappedFile();
+
+  Long64_t GetExtent() const { return fExtent; }
+  Long64_t GetMappedSize() const { return fCapacity; }
+
+  ClassDef(TMappedFile, 0)
+};
+#endif
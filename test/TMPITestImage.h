@@ -0,0 +1,60 @@
+/// \file
+/// \Worker-like file images shared by the tests and benchmarks
+/// \MakeImage fills a TMemFile the way a worker does between two syncs and
+///  returns its serialized image, to be replayed to a collector or merged
+///  directly.
+
+#ifndef TMPI_TEST_IMAGE
+#define TMPI_TEST_IMAGE
+
+#include "JetEvent.h"
+#include "TMemFile.h"
+#include "TTree.h"
+
+#include <mutex>
+#include <vector>
+
+// Fill one worker-like TMemFile with 'events' JetEvent (FlatJetEvent with
+// 'flat', BuildFast() with 'fastgen') and return its serialized image.
+// 'generate' serializes the event generation, which shares gRandom, when
+// threads call it concurrently.
+static std::vector<char> MakeImage(Int_t events, Int_t jetm, Int_t trackm, Int_t hitam, Int_t hitbm,
+                                   Bool_t fastgen = kFALSE, Bool_t flat = kFALSE,
+                                   std::mutex *generate = 0) {
+  TMemFile file("test_input.root", "RECREATE");
+  TTree *tree = new TTree("tree", "Event example with Jets");
+  tree->SetAutoFlush(events);
+  JetEvent *event = 0;
+  FlatJetEvent *flatevent = 0;
+  if (flat) {
+    flatevent = new FlatJetEvent;
+    tree->Branch("event", "FlatJetEvent", &flatevent, 8000, 2);
+  } else {
+    event = new JetEvent;
+    tree->Branch("event", "JetEvent", &event, 8000, 2);
+  }
+  for (Int_t i = 0; i < events; i++) {
+    if (generate) {
+      generate->lock();
+    }
+    if (flat) {
+      flatevent->Build(jetm, trackm, hitam, hitbm);
+    } else if (fastgen) {
+      event->BuildFast(jetm, trackm, hitam, hitbm);
+    } else {
+      event->Build(jetm, trackm, hitam, hitbm);
+    }
+    if (generate) {
+      generate->unlock();
+    }
+    tree->Fill();
+  }
+  file.Write();
+  std::vector<char> image(file.GetEND());
+  file.CopyTo(image.data(), image.size());
+  delete event;
+  delete flatevent;
+  return image;
+}
+
+#endif
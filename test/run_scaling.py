@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+'''Run a scaling matrix of test_tmpi or bench_collector on one machine.
+
+Every (ranks, collectors, sync rate) point of the matrix is run with an
+oversubscribed mpirun; each rank writes its metrics as JSON (the --metrics
+option of the programs, TMPIFile::SetMetricsOutput) and the per-rank files
+are combined into one summary row per point, written as CSV and JSON.
+
+   ./run_scaling.py -p bench_collector -n 4 8 16 -c 1 2 -r 10 100
+   ./run_scaling.py -p test_tmpi -n 8 -c 1 -r 10 -- -n 20
+'''
+import argparse
+import csv
+import glob
+import itertools
+import json
+import logging
+import math
+import os
+import shlex
+import subprocess
+import sys
+logger = logging.getLogger(__name__)
+
+# (series name, ranks it comes from) summarized for every point
+SERIES = [
+   ('wait_time', 'workers'),
+   ('sync_time', 'workers'),
+   ('hidden_time', 'workers'),
+   ('async_block_time', 'workers'),
+   ('probe_time', 'collectors'),
+   ('merge_time', 'collectors'),
+   ('message_size', 'collectors'),
+   ('checkpoint_time', 'collectors'),
+   ('queue_time', 'collectors'),
+   ('merge_time_saved', 'collectors'),
+]
+STATS = ['count', 'mean', 'sigma', 'min', 'p50', 'p90', 'p99', 'max']
+
+# programs sleep to simulate reconstruction by default, not wanted here
+DEFAULT_ARGS = {
+   'test_tmpi': ['-s', '0', '-t', '0'],
+   'bench_collector': [],
+}
+
+
+def main():
+   parser = argparse.ArgumentParser(description='runs a local TMPIFile scaling study')
+   parser.add_argument('-p', '--program', default='bench_collector', choices=sorted(DEFAULT_ARGS),
+                       help='program to run')
+   parser.add_argument('-b', '--bindir', default=os.path.dirname(os.path.abspath(__file__)),
+                       help='directory holding the programs')
+   parser.add_argument('-n', '--ranks', type=int, nargs='+', default=[4, 8], help='total MPI ranks')
+   parser.add_argument('-c', '--collectors', type=int, nargs='+', default=[1], help='collecting ranks')
+   parser.add_argument('-r', '--syncrates', type=int, nargs='+', default=[10], help='events per buffer')
+   parser.add_argument('--repeat', type=int, default=1, help='runs per matrix point')
+   parser.add_argument('--mpirun', default='mpirun --oversubscribe',
+                       help='mpirun command (MPICH does not need --oversubscribe)')
+   parser.add_argument('-o', '--outdir', default='scaling', help='directory for logs, metrics and summary')
+   parser.add_argument('--debug', dest='debug', default=False, action='store_true', help='Set Logger to DEBUG')
+   parser.add_argument('extra', nargs='*', help='extra program arguments, after --')
+   args = parser.parse_args()
+
+   logging.basicConfig(level=logging.DEBUG if args.debug else logging.INFO,
+                       format='%(asctime)s %(levelname)s:%(name)s:%(message)s',
+                       datefmt='%Y-%m-%d %H:%M:%S')
+
+   program = os.path.join(args.bindir, args.program)
+   if not os.path.exists(program):
+      logger.error('%s not found, use --bindir', program)
+      return 1
+   os.makedirs(args.outdir, exist_ok=True)
+
+   rows = []
+   for ranks, collectors, syncrate, run in itertools.product(
+         args.ranks, args.collectors, args.syncrates, range(args.repeat)):
+      if ranks < 2 * collectors:
+         logger.warning('skipping %d ranks with %d collectors, at least two ranks per collector are needed',
+                        ranks, collectors)
+         continue
+      descr = '%dn_%dc_%dr_%d' % (ranks, collectors, syncrate, run)
+      rundir = os.path.join(args.outdir, descr)
+      os.makedirs(rundir, exist_ok=True)
+      for old in glob.glob(os.path.join(rundir, 'metrics_*.json')):
+         os.remove(old)
+
+      command = shlex.split(args.mpirun) + ['-np', str(ranks), program,
+                 '-c', str(collectors), '-r', str(syncrate),
+                 '--metrics', os.path.join(rundir, 'metrics')] + DEFAULT_ARGS[args.program] + args.extra
+      logger.info('running %s', ' '.join(command))
+      with open(os.path.join(rundir, 'stdout.log'), 'w') as log:
+         result = subprocess.run(command, stdout=log, stderr=subprocess.STDOUT)
+      if result.returncode != 0:
+         logger.error('%s failed with exit code %d, see %s', descr, result.returncode, rundir)
+         continue
+
+      row = {'program': args.program, 'ranks': ranks, 'collectors': collectors,
+             'workers': ranks - collectors, 'syncrate': syncrate, 'run': run}
+      row.update(summarize(load_metrics(rundir)))
+      rows.append(row)
+      logger.info('%s: %.2f messages/s, %.2f MB/s, wait time %.4f s, merge time %.4f s', descr,
+                  row['messages_per_second'], row['megabytes_per_second'],
+                  row['wait_time_mean'], row['merge_time_mean'])
+
+   if not rows:
+      logger.error('no successful run')
+      return 1
+   write_summary(rows, args.outdir)
+   return 0
+
+
+def load_metrics(rundir):
+   ranks = []
+   for filename in sorted(glob.glob(os.path.join(rundir, 'metrics_*.json'))):
+      with open(filename) as f:
+         ranks.append(json.load(f))
+   return ranks
+
+
+def summarize(ranks):
+   collectors = [r for r in ranks if r['info'].get('collector')]
+   workers = [r for r in ranks if not r['info'].get('collector')]
+   row = {}
+
+   # the collectors run concurrently, the slowest one bounds the rate
+   run_time = max([max(r['samples'].get('run_time', {}).get('values', [0])) for r in collectors] or [0])
+   messages = sum(r['counters'].get('messages_received', 0) for r in collectors)
+   nbytes = sum(r['counters'].get('bytes_received', 0) for r in collectors)
+   row['messages'] = messages
+   row['megabytes'] = nbytes / 1024. / 1024.
+   row['collector_run_time'] = run_time
+   row['messages_per_second'] = messages / run_time if run_time else 0.
+   row['megabytes_per_second'] = row['megabytes'] / run_time if run_time else 0.
+
+   for name, source in SERIES:
+      values = []
+      for r in (workers if source == 'workers' else collectors):
+         values += r['samples'].get(name, {}).get('values', [])
+      for stat, value in distribution(values).items():
+         row[name + '_' + stat] = value
+   return row
+
+
+def distribution(values):
+   output = dict((stat, 0.) for stat in STATS)
+   output['count'] = len(values)
+   if not values:
+      return output
+   values = sorted(values)
+   n = float(len(values))
+   mean = sum(values) / n
+   output['mean'] = mean
+   output['sigma'] = math.sqrt(max(0., sum(v * v for v in values) / n - mean * mean))
+   output['min'] = values[0]
+   output['max'] = values[-1]
+   for stat, q in (('p50', 0.5), ('p90', 0.9), ('p99', 0.99)):
+      pos = q * (len(values) - 1)
+      low = int(pos)
+      high = min(low + 1, len(values) - 1)
+      output[stat] = values[low] + (pos - low) * (values[high] - values[low])
+   return output
+
+
+def write_summary(rows, outdir):
+   csvname = os.path.join(outdir, 'summary.csv')
+   with open(csvname, 'w', newline='') as f:
+      writer = csv.DictWriter(f, fieldnames=list(rows[0].keys()))
+      writer.writeheader()
+      writer.writerows(rows)
+   jsonname = os.path.join(outdir, 'summary.json')
+   with open(jsonname, 'w') as f:
+      json.dump(rows, f, indent=2)
+   logger.info('summary written to %s and %s', csvname, jsonname)
+
+
+if __name__ == '__main__':
+   sys.exit(main())